@@ -38,12 +38,8 @@ Options parseInput(int argc, char* argv[])
 	}
 }
 
-OptimizationResult processImageOrFolder(const std::string& input, float targetSimilarity, bool recursive)
+OptimizationResult processImageOrFolder(ImageOptimizer& imageOptimizer, const std::string& input, float targetSimilarity, bool recursive)
 {
-	ImageOptimizer imageOptimizer;
-
-	imageOptimizer.SetLogCallbacks([](const char* message) {std::cout << message << std::endl; }, nullptr, nullptr);
-
 	if (fs::is_regular_file(input))
 	{
 		return imageOptimizer.OptimizeImage(input, targetSimilarity);
@@ -65,6 +61,42 @@ OptimizationResult processImageOrFolder(const std::string& input, float targetSi
 	}
 }
 
+SearchStrategy parseSearchStrategy(const std::string& name)
+{
+	if (name == "bisection")
+	{
+		return SearchStrategy::Bisection;
+	}
+	else if (name == "interpolation")
+	{
+		return SearchStrategy::Interpolation;
+	}
+
+	std::cout << "Unknown search strategy " + name + ", use bisection or interpolation" << std::endl;
+
+	exit(1);
+}
+
+SearchProxy parseSearchProxy(const std::string& name)
+{
+	if (name == "none")
+	{
+		return SearchProxy::None;
+	}
+	else if (name == "downscaled")
+	{
+		return SearchProxy::Downscaled;
+	}
+	else if (name == "tiles")
+	{
+		return SearchProxy::Tiles;
+	}
+
+	std::cout << "Unknown search proxy " + name + ", use none, downscaled or tiles" << std::endl;
+
+	exit(1);
+}
+
 bool hasJpegExtension(const std::string& word)
 {
 	const std::regex jpegExtension(R"(\.jpe?g\s*$)", std::regex_constants::icase);
@@ -118,17 +150,40 @@ int main(int argc, char* argv[])
 		}
 	}	
 
+	// The output folder is for sources that must not change
+	if (options.inPlace() && !options.outputFolder().empty())
+	{
+		std::cout << "--in-place and --output can't be used together" << std::endl;
+
+		return 1;
+	}
+
 	std::cout << ImageOptimizer::GetVersion() << std::endl;
 
 	std::vector<OptimizationResult> results;
 
+	ImageOptimizer imageOptimizer(options.threads());
+
+	imageOptimizer.SetLogCallbacks([](const char* message) {std::cout << message << std::endl; }, nullptr, nullptr);
+	imageOptimizer.SetSearchStrategy(parseSearchStrategy(options.searchStrategy()));
+	imageOptimizer.SetSsimConfidence(options.confidence());
+	imageOptimizer.SetSearchProxy(parseSearchProxy(options.searchProxy()));
+	imageOptimizer.SetIoThreads(options.readerThreads(), options.writerThreads());
+	imageOptimizer.SetIoUring(options.ioUring());
+	imageOptimizer.SetSyncOutputs(options.syncOutputs());
+	imageOptimizer.SetLinkOriginals(options.linkOriginals());
+	imageOptimizer.SetInPlace(options.inPlace());
+	imageOptimizer.SetOutputFolder(options.outputFolder());
+
 	auto start = std::chrono::steady_clock::now();
 
 	try
 	{
+		imageOptimizer.SetResultCache(options.cachePath());
+
 		for (const auto& input : options.input())
 		{
-			results.push_back(processImageOrFolder(input, options.ssimScore(), options.recursive()));
+			results.push_back(processImageOrFolder(imageOptimizer, input, options.ssimScore(), options.recursive()));
 		}		
 	}
 	catch (const std::exception& e)
@@ -20,7 +20,19 @@ public:
 			("h,help", "Print help", cxxopts::value<bool>()->default_value("false")->target(&(option.m_help)))
 			("i,input", "Image or folder to process", cxxopts::value<std::vector<std::string>>()->default_value(".")->target(&(option.m_input)))
 			("r,recursive", "Recursive folder processing", cxxopts::value<bool>()->default_value("false")->target(&(option.m_recursive)))
-			("s,ssim", "Similarity score", cxxopts::value<float>()->default_value("0.9999")->target(&(option.m_ssimScore)));
+			("s,ssim", "Similarity score", cxxopts::value<float>()->default_value("0.9999")->target(&(option.m_ssimScore)))
+			("t,threads", "Number of threads, 0 uses all cores", cxxopts::value<unsigned int>()->default_value("0")->target(&(option.m_threads)))
+			("search", "Quality search strategy: bisection or interpolation", cxxopts::value<std::string>()->default_value("bisection")->target(&(option.m_searchStrategy)))
+			("confidence", "Confidence for stopping the ssim of a probe early, 1 only stops when the result is certain", cxxopts::value<double>()->default_value("1")->target(&(option.m_confidence)))
+			("proxy", "Image the quality is searched on before verifying it at full size: none, downscaled or tiles", cxxopts::value<std::string>()->default_value("none")->target(&(option.m_searchProxy)))
+			("cache", "File remembering the images already optimized, so later runs skip them", cxxopts::value<std::string>()->default_value("")->target(&(option.m_cachePath)))
+			("readers", "Threads reading images, 1 suits spinning disks", cxxopts::value<unsigned int>()->default_value("2")->target(&(option.m_readerThreads)))
+			("writers", "Threads writing the optimized images", cxxopts::value<unsigned int>()->default_value("1")->target(&(option.m_writerThreads)))
+			("io-uring", "Read and write the images by batches through io_uring, where the kernel supports it", cxxopts::value<bool>()->default_value("false")->target(&(option.m_ioUring)))
+			("sync", "Make the outputs durable before returning, with one sync per file system", cxxopts::value<bool>()->default_value("false")->target(&(option.m_syncOutputs)))
+			("hardlink", "Link the images that couldn't be compressed as their output instead of copying them", cxxopts::value<bool>()->default_value("false")->target(&(option.m_linkOriginals)))
+			("in-place", "Replace the images by their optimized version instead of writing it next to them", cxxopts::value<bool>()->default_value("false")->target(&(option.m_inPlace)))
+			("o,output", "Folder the optimized images are written to, mirroring the input folders, instead of next to the images", cxxopts::value<std::string>()->default_value("")->target(&(option.m_outputFolder)));
 
 		options.parse_positional("input");
 
@@ -56,12 +68,84 @@ public:
 		return m_ssimScore;
 	}
 
+	unsigned int threads() const
+	{
+		return m_threads;
+	}
+
+	std::string searchStrategy() const
+	{
+		return m_searchStrategy;
+	}
+
+	double confidence() const
+	{
+		return m_confidence;
+	}
+
+	std::string searchProxy() const
+	{
+		return m_searchProxy;
+	}
+
+	std::string cachePath() const
+	{
+		return m_cachePath;
+	}
+
+	unsigned int readerThreads() const
+	{
+		return m_readerThreads;
+	}
+
+	unsigned int writerThreads() const
+	{
+		return m_writerThreads;
+	}
+
+	bool ioUring() const
+	{
+		return m_ioUring;
+	}
+
+	bool syncOutputs() const
+	{
+		return m_syncOutputs;
+	}
+
+	bool linkOriginals() const
+	{
+		return m_linkOriginals;
+	}
+
+	bool inPlace() const
+	{
+		return m_inPlace;
+	}
+
+	std::string outputFolder() const
+	{
+		return m_outputFolder;
+	}
+
 private:
 	Options() = default;
 
 	std::vector<std::string> m_input;
 	std::string m_helpMessage;
 	float m_ssimScore;
+	unsigned int m_threads;
+	std::string m_searchStrategy;
+	double m_confidence;
+	std::string m_searchProxy;
+	std::string m_cachePath;
+	unsigned int m_readerThreads;
+	unsigned int m_writerThreads;
+	bool m_ioUring;
+	bool m_syncOutputs;
+	bool m_linkOriginals;
+	bool m_inPlace;
+	std::string m_outputFolder;
 	bool m_recursive;
 	bool m_help;
 };
@@ -3,40 +3,124 @@
 #include "iopt/logger.hpp"
 #include "iopt/image_similarity.hpp"
 #include "iopt/optimization_result.hpp"
+#include "iopt/search_strategy.hpp"
 
+#include <cstdint>
+#include <functional>
 #include <string>
 #include <vector>
+#include <memory>
 #include <filesystem>
 
 class ImageProcessor;
+class ThreadPool;
+class TaskGroup;
+class ResultCache;
+class IoRing;
+class OutputWriter;
+class OutputNames;
+
+template <typename T>
+class BoundedQueue;
 
 class  ImageOptimizer
 {
 public:
-	ImageOptimizer();
+	// threadCount 0 uses one thread per hardware thread
+	explicit ImageOptimizer(unsigned int threadCount = 0);
 	~ImageOptimizer();
 
 	void SetLogCallbacks(traceCallback_t traceCallback, warningCallback_t warningCallback, errorCallback_t errorCallback);
+	void SetSearchStrategy(SearchStrategy searchStrategy);
+
+	// Probes whose ssim is on one side of the target with this confidence stop early, 1 means only when it is certain
+	void SetSsimConfidence(double confidence);
+
+	void SetSearchProxy(SearchProxy searchProxy);
+
+	// Files already optimized for the same similarity, according to the cache file, are skipped without decoding.
+	// An empty path disables the cache
+	void SetResultCache(const std::string& cachePath);
+
+	// Folders are processed as a pipeline: reader threads load files ahead of the pool that decodes and
+	// searches them, writer threads save the results. One reader suits spinning disks, SSDs keep up with more
+	void SetIoThreads(unsigned int readerThreads, unsigned int writerThreads);
+
+	// Each reader and writer thread moves its files through an io_uring by batches, which keeps more transfers
+	// in flight on fast drives. Only on Linux, blocking calls are used where the kernel doesn't support it
+	void SetIoUring(bool enabled);
+
+	// Outputs are synced once at the end of each call, with one sync per file system rather than one per file
+	void SetSyncOutputs(bool enabled);
+
+	// Images that couldn't be compressed are hard linked as their output instead of copied. Where the file system
+	// supports it they otherwise share the data of the original anyway, and a change to one doesn't affect the other
+	void SetLinkOriginals(bool enabled);
+
+	// Optimized images replace their original instead of being written next to it, keeping its owner, permissions
+	// and times. Originals that couldn't be compressed are left as they are. Throws when an output folder is set
+	void SetInPlace(bool enabled);
+
+	// Outputs are written under this folder rather than next to their image, at the path the image has relative to the
+	// folder being optimized. Folders are created as they are walked, the output folder may be on another file system.
+	// Empty writes next to the images. Throws when images are optimized in place
+	void SetOutputFolder(const std::string& outputFolderPath);
 
 	OptimizationResult OptimizeImage(const std::string& imagePath, ImageSimilarity::Similarity similarity);
 	OptimizationResult OptimizeFolder(const std::string& imageFolderPath, ImageSimilarity::Similarity similarity);
 	OptimizationResult OptimizeFolderRecursive(const std::string& imageFolderPath, ImageSimilarity::Similarity similarity);
 
+	unsigned int GetThreadCount() const;
+
 	static std::string GetVersion();
 	
 private:
 	using filesize_t = unsigned long long;
-	using iterator_t = std::vector<std::string>::const_iterator;
+	using PathQueue = BoundedQueue<std::string>;
 
-	static std::string addSuffixToFileName(const std::string& filename, const std::string& suffix);
+	// What is passed from one stage of the pipeline to the next
+	struct LoadedImage;
+	struct EncodedImage;
 
 	static bool isJpegFile(const std::filesystem::directory_entry& file);
 	static std::vector<std::string> getJpegInFolder(const std::string& imageFolderPath);
-	static std::vector<std::string> getAllFoldersInFolder(const std::string& folderPath);
-	static std::string getSuffixedFilename(const std::string& filename, const std::string& suffix);
+
+	void walkFolder(TaskGroup& taskGroup, const std::filesystem::path& folderPath, PathQueue& imagePaths);
 
 	OptimizationResult parallelOptimizeImages(const std::vector<std::string>& filenames, ImageSimilarity::Similarity similarity);
-	OptimizationResult optimizeImages(const iterator_t& first, const iterator_t& last, ImageSimilarity::Similarity similarity);
+
+	// The producer pushes the paths of the images, the pipeline runs until it returns and every image is written
+	OptimizationResult pipelineOptimizeImages(const std::function<void(PathQueue&)>& producer, ImageSimilarity::Similarity similarity, unsigned int parallelProbes);
+
+	OptimizationResult optimizeImage(const std::string& imagePath, ImageSimilarity::Similarity similarity, unsigned int parallelProbes);
+
+	// Stages of the optimization of an image. Reading returns false when the result is already known
+	bool readImage(const std::string& imagePath, ImageSimilarity::Similarity similarity, LoadedImage& image, OptimizationResult& knownResult);
+	void encodeImage(LoadedImage& image, ImageSimilarity::Similarity similarity, unsigned int parallelProbes, EncodedImage& encoded);
+	OptimizationResult writeImage(const EncodedImage& encoded, ImageSimilarity::Similarity similarity);
+
+	// The same stages for a batch, ring may be null
+	void readImages(IoRing* ring, const std::vector<std::string>& imagePaths, ImageSimilarity::Similarity similarity, std::vector<LoadedImage>& images, OptimizationResult& knownResults);
+	OptimizationResult writeImages(IoRing* ring, const std::vector<EncodedImage>& images, ImageSimilarity::Similarity similarity);
+
+	// Looked up from the metadata of the file, then from its content once it is loaded
+	bool findKnownResult(const std::string& imagePath, ImageSimilarity::Similarity similarity, LoadedImage& image, OptimizationResult& knownResult);
+	bool findKnownContent(LoadedImage& image, ImageSimilarity::Similarity similarity, OptimizationResult& knownResult);
+	bool findCachedResult(uint64_t contentHash, ImageSimilarity::Similarity similarity, const std::string& imagePath, OptimizationResult& knownResult);
+
+	OptimizationResult keepImage(const EncodedImage& encoded, ImageSimilarity::Similarity similarity);
+	OptimizationResult recordOutput(const EncodedImage& encoded, const std::string& outputPath, ImageSimilarity::Similarity similarity);
+
+	// The image path, or its mirror under the output folder
+	void setInputFolder(const std::filesystem::path& inputFolderPath);
+	std::string outputLocation(const std::string& imagePath) const;
+	void createOutputFolder(const std::filesystem::path& folderPath);
+	bool isOutputFolder(const std::filesystem::path& folderPath) const;
+
+	// Logs the error of a failed stage, the image is skipped
+	bool tryStage(const std::string& imagePath, const std::function<void()>& stage);
+
+	void cacheResult(uint64_t contentHash, ImageSimilarity::Similarity similarity, unsigned int quality, const OptimizationResult& result);
 
 	Image loadImage(const std::string& imagePath);
 
@@ -50,5 +134,22 @@ private:
 
 	Logger m_logger;
 
+	std::unique_ptr<ThreadPool> m_threadPool;
 	std::unique_ptr<ImageProcessor> m_imageProcessor;
+	std::unique_ptr<ResultCache> m_resultCache;
+	std::unique_ptr<OutputWriter> m_outputWriter;
+	std::unique_ptr<OutputNames> m_outputNames;
+
+	unsigned int m_readerThreads = 2;
+	unsigned int m_writerThreads = 1;
+	bool m_ioUring = false;
+	bool m_syncOutputs = false;
+	bool m_linkOriginals = false;
+	bool m_inPlace = false;
+	std::string m_outputFolder;
+
+	// Of the current call, the output folder mirrors it
+	std::filesystem::path m_inputFolder;
+
+	static constexpr unsigned int s_ioBatchSize = 16;
 };
@@ -33,5 +33,18 @@ namespace ImageSimilarity
 
 	std::ostream& operator<< (std::ostream& stream, Similarity similarity);
 
+	// Of a comparison that can stop early: without every window compared the value is the mean of the windows compared so far,
+	// it is only known to be on the same side of the target as the ssim
+	struct SsimEstimate
+	{
+		Similarity similarity;
+		bool exact;
+	};
+
 	Similarity ComputeSsim(const Image& referenceImage, const Image& compareImage);
+
+	// Compares row bands spread over the image and stops as soon as the result is known to be on one side of the target.
+	// With confidence 1 it only stops when the remaining windows can't bring the mean across the target, lower values
+	// also stop when the sampled bands put it on one side with that probability
+	SsimEstimate ComputeSsim(const Image& referenceImage, const Image& compareImage, Similarity targetSimilarity, double confidence = 1.0);
 }
@@ -0,0 +1,21 @@
+#pragma once
+
+// How the next quality to try is chosen while searching for the target similarity
+enum class SearchStrategy
+{
+	// Midpoint of the remaining quality range
+	Bisection,
+	// Regula falsi on the qualities already tried, usually needs fewer encodes
+	Interpolation
+};
+
+// What the quality search encodes, when it isn't the full image the quality found is then verified on the full image
+enum class SearchProxy
+{
+	// The full image
+	None,
+	// The image scaled down by 4 in both directions, only used on images large enough to keep a meaningful ssim
+	Downscaled,
+	// A mosaic of 1/16 of the image, in tiles aligned to the jpeg blocks and sampled evenly over their range of variance
+	Tiles
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <limits>
+#include <mutex>
+
+
+// FIFO between threads: Push blocks while the queue is full, Pop while it is empty.
+// Once closed, pushes are refused and pops drain what is left
+template <typename T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity = std::numeric_limits<size_t>::max()) : m_capacity{ capacity > 0 ? capacity : 1 } {}
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	// False when the queue was closed
+	bool Push(T item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		m_notFull.wait(lock, [this]() { return m_closed || m_items.size() < m_capacity; });
+
+		if (m_closed)
+		{
+			return false;
+		}
+
+		m_items.push_back(std::move(item));
+
+		lock.unlock();
+		m_notEmpty.notify_one();
+
+		return true;
+	}
+
+	// False when the queue is closed and empty
+	bool Pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		m_notEmpty.wait(lock, [this]() { return m_closed || !m_items.empty(); });
+
+		if (m_items.empty())
+		{
+			return false;
+		}
+
+		item = std::move(m_items.front());
+		m_items.pop_front();
+
+		lock.unlock();
+		m_notFull.notify_one();
+
+		return true;
+	}
+
+	// Doesn't wait, false when the queue is empty
+	bool TryPop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		if (m_items.empty())
+		{
+			return false;
+		}
+
+		item = std::move(m_items.front());
+		m_items.pop_front();
+
+		lock.unlock();
+		m_notFull.notify_one();
+
+		return true;
+	}
+
+	void Close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_closed = true;
+		}
+
+		m_notFull.notify_all();
+		m_notEmpty.notify_all();
+	}
+
+private:
+	const size_t m_capacity;
+
+	std::mutex m_mutex;
+	std::condition_variable m_notFull;
+	std::condition_variable m_notEmpty;
+	std::deque<T> m_items;
+	bool m_closed = false;
+};
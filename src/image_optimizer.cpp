@@ -1,17 +1,98 @@
 #include "iopt/image_optimizer.hpp"
 
+#include "bounded_queue.hpp"
 #include "iopt/logger.hpp"
 #include "jpeg.hpp"
 #include "iopt/optimization_result.hpp"
 #include "image_processor.hpp"
+#include "io_ring.hpp"
+#include "output_names.hpp"
+#include "output_writer.hpp"
+#include "result_cache.hpp"
+#include "thread_pool.hpp"
+#include "xxhash.hpp"
 
 #include <regex>
+#include <mutex>
 #include <future>
-#include <numeric>
+#include <algorithm>
+#include <cstring>
+#include <thread>
 
 namespace fs = std::filesystem;
 
 
+struct ImageOptimizer::LoadedImage
+{
+	std::string path;
+	jpeg::FileData data;
+	uint64_t contentHash = 0;
+
+	// From the metadata, when the result cache is used
+	std::optional<ResultCache::FileIdentity> identity;
+	std::optional<uint64_t> knownHash;
+};
+
+struct ImageOptimizer::EncodedImage
+{
+	std::string path;
+	uint64_t contentHash = 0;
+	ImageOptimizer::filesize_t originalSize = 0;
+
+	// 0 when the original is kept
+	unsigned int quality = 0;
+	jpeg::Buffer data;
+
+	bool IsCompressed() const { return quality != 0 && data.Size() < originalSize; }
+};
+
+namespace
+{
+	// Waits for the first item only, then takes what is already queued
+	template <typename T>
+	bool popBatch(BoundedQueue<T>& queue, std::vector<T>& batch, size_t size)
+	{
+		batch.clear();
+
+		T item;
+
+		if (!queue.Pop(item))
+		{
+			return false;
+		}
+
+		batch.push_back(std::move(item));
+
+		while (batch.size() < size && queue.TryPop(item))
+		{
+			batch.push_back(std::move(item));
+		}
+
+		return true;
+	}
+
+	// In place the output takes the place of the image. Otherwise a name taken since the folder was listed can't be
+	// committed to, the next one is tried then
+	std::string commitOutput(OutputWriter& writer, OutputNames& names, OutputWriter::PendingFile& file, const std::string& imagePath, bool inPlace)
+	{
+		if (inPlace)
+		{
+			writer.Replace(file, imagePath);
+
+			return imagePath;
+		}
+
+		auto outputPath = names.Next(imagePath);
+
+		while (!writer.Commit(file, outputPath))
+		{
+			outputPath = names.Next(imagePath);
+		}
+
+		return outputPath;
+	}
+}
+
 const std::string ImageOptimizer::s_version = "0.0.0";
 
 std::string ImageOptimizer::GetVersion()
@@ -19,13 +100,92 @@ std::string ImageOptimizer::GetVersion()
 	return s_version;
 }
 
-ImageOptimizer::ImageOptimizer() :
-	m_imageProcessor(new ImageProcessor(m_logger))
+ImageOptimizer::ImageOptimizer(unsigned int threadCount) :
+	m_threadPool(new ThreadPool(threadCount)),
+	m_imageProcessor(new ImageProcessor(m_logger, *m_threadPool)),
+	m_outputWriter(new OutputWriter()),
+	m_outputNames(new OutputNames("_compressed"))
 {
 }
 
 ImageOptimizer::~ImageOptimizer() = default;
 
+void ImageOptimizer::SetSearchStrategy(SearchStrategy searchStrategy)
+{
+	m_imageProcessor->SetSearchStrategy(searchStrategy);
+}
+
+void ImageOptimizer::SetSsimConfidence(double confidence)
+{
+	m_imageProcessor->SetSsimConfidence(confidence);
+}
+
+void ImageOptimizer::SetSearchProxy(SearchProxy searchProxy)
+{
+	m_imageProcessor->SetSearchProxy(searchProxy);
+}
+
+void ImageOptimizer::SetResultCache(const std::string& cachePath)
+{
+	m_resultCache.reset(cachePath.empty() ? nullptr : new ResultCache(cachePath));
+
+	if (m_resultCache && m_resultCache->WasConverted())
+	{
+		m_logger.warning("Result cache " + cachePath + " was written by an earlier version, it was converted");
+	}
+}
+
+void ImageOptimizer::SetIoUring(bool enabled)
+{
+	m_ioUring = enabled && IoRing::Create(s_ioBatchSize) != nullptr;
+
+	if (enabled && !m_ioUring)
+	{
+		m_logger.warning("io_uring isn't available, files are read and written with blocking calls");
+	}
+}
+
+void ImageOptimizer::SetSyncOutputs(bool enabled)
+{
+	m_syncOutputs = enabled;
+}
+
+void ImageOptimizer::SetLinkOriginals(bool enabled)
+{
+	m_linkOriginals = enabled;
+}
+
+void ImageOptimizer::SetInPlace(bool enabled)
+{
+	if (enabled && !m_outputFolder.empty())
+	{
+		handleInvalidArgument("Images can't be optimized in place when the outputs go to another folder");
+	}
+
+	m_inPlace = enabled;
+}
+
+void ImageOptimizer::SetOutputFolder(const std::string& outputFolderPath)
+{
+	if (m_inPlace && !outputFolderPath.empty())
+	{
+		handleInvalidArgument("Outputs can't go to another folder when images are optimized in place");
+	}
+
+	m_outputFolder = outputFolderPath;
+}
+
+void ImageOptimizer::SetIoThreads(unsigned int readerThreads, unsigned int writerThreads)
+{
+	m_readerThreads = std::max(readerThreads, 1u);
+	m_writerThreads = std::max(writerThreads, 1u);
+}
+
+unsigned int ImageOptimizer::GetThreadCount() const
+{
+	return m_threadPool->GetThreadCount();
+}
+
 void ImageOptimizer::SetLogCallbacks(traceCallback_t traceCallback, warningCallback_t warningCallback, errorCallback_t errorCallback)
 {
 	m_logger.setCallbacks(traceCallback, warningCallback, errorCallback);
@@ -39,139 +199,639 @@ OptimizationResult ImageOptimizer::OptimizeFolder(const std::string& imageFolder
 
 	auto filenames = getJpegInFolder(imageFolderPath);
 
+	setInputFolder(imageFolderPath);
+	createOutputFolder(imageFolderPath);
+
 	return parallelOptimizeImages(filenames, similarity);
 }
 
+// The tree is walked on the pool while its images are optimized, the first image starts as soon as its folder is listed
 OptimizationResult ImageOptimizer::OptimizeFolderRecursive(const std::string& imageFolderPath, ImageSimilarity::Similarity similarity)
 {
 	validateFolderPath(imageFolderPath);
 
-	std::vector<std::string> filenames{ getJpegInFolder(imageFolderPath) };
+	setInputFolder(imageFolderPath);
+	createOutputFolder(imageFolderPath);
+
+	return pipelineOptimizeImages([this, folder = fs::path(imageFolderPath)](PathQueue& imagePaths) {
+		TaskGroup taskGroup{ *m_threadPool };
+
+		taskGroup.Run([this, &taskGroup, &folder, &imagePaths]() { walkFolder(taskGroup, folder, imagePaths); });
+
+		taskGroup.Wait();
+	}, similarity, 1);
+}
 
-	auto folders = getAllFoldersInFolder(imageFolderPath);
+// Lists a single folder: subfolders become walking tasks of their own, so idle workers steal them and
+// the walk spreads over the pool, then the images are queued for reading, largest files first
+void ImageOptimizer::walkFolder(TaskGroup& taskGroup, const fs::path& folderPath, PathQueue& imagePaths)
+{
+	std::vector<std::pair<filesize_t, fs::path>> images;
 
-	for (const auto& folder : folders)
+	try
 	{
-		auto images{ getJpegInFolder(folder) };
-		filenames.insert(filenames.end(), images.begin(), images.end()); // v1.insert(v1.end(), make_move_iterator(v2.begin()), make_move_iterator(v2.end()));
+		for (auto& entry : fs::directory_iterator(folderPath))
+		{
+			// Like recursive_directory_iterator, links to folders aren't followed so the walk can't loop
+			if (entry.is_directory() && !entry.is_symlink())
+			{
+				// An output folder inside the tree holds outputs only
+				if (isOutputFolder(entry.path()))
+				{
+					continue;
+				}
+
+				taskGroup.Run([this, &taskGroup, folder = entry.path(), &imagePaths]() { walkFolder(taskGroup, folder, imagePaths); });
+			}
+			else if (isJpegFile(entry))
+			{
+				// The size comes with the listing on most systems, unlike the dimensions
+				std::error_code error;
+				images.emplace_back(entry.file_size(error), entry.path());
+			}
+		}
+	}
+	catch (const std::exception& e)
+	{
+		m_logger.trace("Unable to list folder " + folderPath.string() + ": \n" + std::string(e.what()));
 	}
 
-	return parallelOptimizeImages(filenames, similarity);
+	std::stable_sort(images.begin(), images.end(), [](const auto& first, const auto& second) {return first.first > second.first; });
+
+	// Before its images are queued, so writers never have to create folders
+	if (!images.empty())
+	{
+		createOutputFolder(folderPath);
+	}
+
+	for (auto& image : images)
+	{
+		imagePaths.Push(image.second.string());
+	}
 }
 
-OptimizationResult ImageOptimizer::optimizeImages(const iterator_t& first, const iterator_t& last, ImageSimilarity::Similarity similarity)
+OptimizationResult ImageOptimizer::parallelOptimizeImages(const std::vector<std::string>& filenames, ImageSimilarity::Similarity similarity)
 {
-	OptimizationResult result;
+	// With fewer images than threads the spare ones evaluate several qualities of the same image at once
+	const auto threadCount = m_threadPool->GetThreadCount();
+	const auto parallelProbes = (!filenames.empty() && filenames.size() < threadCount) ? static_cast<unsigned int>(threadCount / filenames.size()) : 1u;
 
-	for (auto image = first; image != last; ++image)
-	{
-		try
+	return pipelineOptimizeImages([&filenames](PathQueue& imagePaths) {
+		for (const auto& filename : filenames)
 		{
-			result += OptimizeImage(*image, similarity);
+			imagePaths.Push(filename);
 		}
-		catch (const std::exception& e)
+	}, similarity, parallelProbes);
+}
+
+// Files are read by the reader threads, every loaded file becomes a task of the pool that decodes, searches
+// and encodes it, and the writer threads save the results. The queues between the stages hold about one image
+// per pool thread: readers wait when the pool falls behind, so memory stays bounded, and the pool never waits on a disk
+OptimizationResult ImageOptimizer::pipelineOptimizeImages(const std::function<void(PathQueue&)>& producer, ImageSimilarity::Similarity similarity, unsigned int parallelProbes)
+{
+	const auto queueCapacity = m_threadPool->GetThreadCount();
+
+	PathQueue imagePaths;
+	BoundedQueue<LoadedImage> loadedImages{ queueCapacity };
+	BoundedQueue<EncodedImage> encodedImages{ queueCapacity };
+
+	TaskGroup encodeTasks{ *m_threadPool };
+
+	OptimizationResult result;
+	std::mutex resultMutex;
+
+	auto addResult = [&result, &resultMutex](const OptimizationResult& imageResult) {
+		std::lock_guard<std::mutex> lock(resultMutex);
+		result += imageResult;
+	};
+
+	auto encodeTask = [this, &loadedImages, &encodedImages, similarity, parallelProbes]() {
+		// Each task was queued along with an image, so there is always one to take
+		LoadedImage image;
+		loadedImages.Pop(image);
+
+		EncodedImage encoded;
+
+		if (tryStage(image.path, [&]() { encodeImage(image, similarity, parallelProbes, encoded); }))
 		{
-			m_logger.trace("Error during optimization, unable to process image " + *image + ": \n" + std::string(e.what()));
+			encodedImages.Push(std::move(encoded));
 		}
+	};
+
+	std::vector<std::thread> readers;
+	std::vector<std::thread> writers;
+
+	for (unsigned int i = 0; i < m_readerThreads; i++)
+	{
+		encodeTasks.Enter();
+
+		readers.emplace_back([this, &imagePaths, &loadedImages, &encodeTasks, &encodeTask, &addResult, similarity]() {
+			// Rings belong to a single thread, with one the reader takes the paths by batches
+			auto ring = m_ioUring ? IoRing::Create(s_ioBatchSize) : nullptr;
+
+			std::vector<std::string> batch;
+
+			while (popBatch(imagePaths, batch, ring ? s_ioBatchSize : 1))
+			{
+				std::vector<LoadedImage> images;
+				OptimizationResult knownResults;
+
+				readImages(ring.get(), batch, similarity, images, knownResults);
+
+				addResult(knownResults);
+
+				for (auto& image : images)
+				{
+					loadedImages.Push(std::move(image));
+					encodeTasks.Run(encodeTask);
+				}
+			}
+
+			encodeTasks.Leave();
+		});
 	}
 
+	for (unsigned int i = 0; i < m_writerThreads; i++)
+	{
+		writers.emplace_back([this, &encodedImages, &addResult, similarity]() {
+			auto ring = m_ioUring ? IoRing::Create(s_ioBatchSize) : nullptr;
+
+			std::vector<EncodedImage> batch;
+
+			while (popBatch(encodedImages, batch, ring ? s_ioBatchSize : 1))
+			{
+				addResult(writeImages(ring.get(), batch, similarity));
+			}
+		});
+	}
+
+	producer(imagePaths);
+	imagePaths.Close();
+
+	// Returns once the readers are done and every image they loaded is encoded, the waiting thread helps the pool meanwhile
+	encodeTasks.Wait();
+	encodedImages.Close();
+
+	for (auto& reader : readers)
+	{
+		reader.join();
+	}
+
+	for (auto& writer : writers)
+	{
+		writer.join();
+	}
+
+	if (m_syncOutputs)
+	{
+		m_outputWriter->Sync();
+	}
+
+	m_outputNames->Clear();
+
 	return result;
 }
 
-OptimizationResult ImageOptimizer::parallelOptimizeImages(const std::vector<std::string>& filenames, ImageSimilarity::Similarity similarity)
+void ImageOptimizer::setInputFolder(const fs::path& inputFolderPath)
 {
-	const auto nthreads = std::thread::hardware_concurrency();
-	const auto nfiles = filenames.size();
-	const auto imagesPerThread = nfiles / nthreads;
+	m_inputFolder = inputFolderPath.lexically_normal();
+}
 
-	std::vector<std::future<OptimizationResult>> futures;
+// Same path relative to the output folder as the image has relative to the folder being optimized
+std::string ImageOptimizer::outputLocation(const std::string& imagePath) const
+{
+	if (m_outputFolder.empty())
+	{
+		return imagePath;
+	}
+
+	return (fs::path(m_outputFolder) / fs::path(imagePath).lexically_normal().lexically_relative(m_inputFolder)).lexically_normal().string();
+}
+
+bool ImageOptimizer::isOutputFolder(const fs::path& folderPath) const
+{
+	if (m_outputFolder.empty())
+	{
+		return false;
+	}
+
+	std::error_code error;
+
+	return fs::equivalent(folderPath, m_outputFolder, error);
+}
 
-	for (size_t t = 0; t < nthreads; t++)
+// Images of a folder that can't be created fail when written, with the reason
+void ImageOptimizer::createOutputFolder(const fs::path& folderPath)
+{
+	if (m_outputFolder.empty())
 	{
-		size_t firstImage = imagesPerThread * t;
-		size_t lastImage = imagesPerThread * (t + 1);
+		return;
+	}
+
+	std::error_code error;
+	fs::create_directories(outputLocation(folderPath.string()), error);
 
-		futures.push_back(std::async(std::launch::async, [=]() {return optimizeImages(filenames.cbegin() + firstImage, filenames.cbegin() + lastImage, similarity); }));
+	if (error)
+	{
+		m_logger.trace("Unable to create output folder for " + folderPath.string() + ": \n" + error.message());
 	}
+}
 
-	size_t first = imagesPerThread * nthreads;
+bool ImageOptimizer::tryStage(const std::string& imagePath, const std::function<void()>& stage)
+{
+	try
+	{
+		stage();
 
-	OptimizationResult result = optimizeImages(filenames.cbegin() + first, filenames.cend(), similarity);
+		return true;
+	}
+	catch (const std::exception& e)
+	{
+		m_logger.trace("Error during optimization, unable to process image " + imagePath + ": \n" + std::string(e.what()));
+	}
 
-	return std::accumulate(futures.begin(), futures.end(), result, [](auto& total, auto& future) {return total + future.get(); });
+	return false;
 }
 
+OptimizationResult ImageOptimizer::OptimizeImage(const std::string& imagePath, ImageSimilarity::Similarity similarity)
+{
+	setInputFolder(fs::path(imagePath).parent_path());
+	createOutputFolder(m_inputFolder);
 
-inline uint8_t fastRound(float value) {
-	return static_cast<uint8_t>(value > 0.0f ? (value + 0.5f) : (value - 0.5f));
+	// A single image gets the whole pool for its quality search
+	auto result = optimizeImage(imagePath, similarity, m_threadPool->GetThreadCount());
+
+	if (m_syncOutputs)
+	{
+		m_outputWriter->Sync();
+	}
+
+	m_outputNames->Clear();
+
+	return result;
 }
 
-auto colorToGray(const Image& colorImage) {
-	Image grayImage;
-	grayImage.width = colorImage.width;
-	grayImage.height = colorImage.height;
-	grayImage.data = std::vector<uint8_t>(grayImage.width * grayImage.height);
+OptimizationResult ImageOptimizer::optimizeImage(const std::string& imagePath, ImageSimilarity::Similarity similarity, unsigned int parallelProbes)
+{
+	LoadedImage image;
+	OptimizationResult result;
 
-	const auto size = grayImage.data.size();
-	const uint8_t* pColor = colorImage.data.data();
-	uint8_t* pGray = grayImage.data.data();
-	for (size_t i = 0; i < size; i++) {
-		auto r = pColor[i * 3 + 0];
-		auto g = pColor[i * 3 + 1];
-		auto b = pColor[i * 3 + 2];
-		pGray[i] = fastRound(+0.299f * r + 0.587f * g + 0.114f * b);
+	if (!readImage(imagePath, similarity, image, result))
+	{
+		return result;
 	}
 
-	return grayImage;
+	EncodedImage encoded;
+	encodeImage(image, similarity, parallelProbes, encoded);
+
+	return writeImage(encoded, similarity);
 }
 
-OptimizationResult ImageOptimizer::OptimizeImage( const std::string& imagePath, ImageSimilarity::Similarity similarity)
+bool ImageOptimizer::readImage(const std::string& imagePath, ImageSimilarity::Similarity similarity, LoadedImage& image, OptimizationResult& knownResult)
 {
- 	m_logger.trace(imagePath.data());
+	if (findKnownResult(imagePath, similarity, image, knownResult))
+	{
+		return false;
+	}
+
+	image.data = jpeg::load_file(imagePath);
+
+	return !findKnownContent(image, similarity, knownResult);
+}
+
+// Reads the batch through the ring when there is one, files it can't read are left to blocking reads
+void ImageOptimizer::readImages(IoRing* ring, const std::vector<std::string>& imagePaths, ImageSimilarity::Similarity similarity, std::vector<LoadedImage>& images, OptimizationResult& knownResults)
+{
+	std::vector<LoadedImage> unread;
+	std::vector<IoRing::FileRead> reads;
+
+	for (const auto& imagePath : imagePaths)
+	{
+		LoadedImage image;
+		OptimizationResult knownResult;
+		bool known = false;
+		bool loaded = false;
+
+		if (!tryStage(imagePath, [&]() {
+			if (ring == nullptr)
+			{
+				loaded = readImage(imagePath, similarity, image, knownResult);
+				known = !loaded;
+			}
+			else
+			{
+				known = findKnownResult(imagePath, similarity, image, knownResult);
+			}
+		}))
+		{
+			continue;
+		}
+
+		if (known)
+		{
+			knownResults += knownResult;
+		}
+		else if (loaded)
+		{
+			images.push_back(std::move(image));
+		}
+		else
+		{
+			reads.push_back({ imagePath, {} });
+			unread.push_back(std::move(image));
+		}
+	}
+
+	if (reads.empty())
+	{
+		return;
+	}
+
+	ring->ReadFiles(reads);
+
+	for (size_t i = 0; i < reads.size(); i++)
+	{
+		auto& image = unread[i];
+		OptimizationResult knownResult;
+		bool known = false;
+
+		if (tryStage(image.path, [&]() {
+			image.data = (reads[i].error == 0) ? jpeg::FileData(std::move(reads[i].data)) : jpeg::load_file(image.path);
+			known = findKnownContent(image, similarity, knownResult);
+		}))
+		{
+			if (known)
+			{
+				knownResults += knownResult;
+			}
+			else
+			{
+				images.push_back(std::move(image));
+			}
+		}
+	}
+}
+
+// Files whose metadata didn't change since they were hashed aren't even read
+bool ImageOptimizer::findKnownResult(const std::string& imagePath, ImageSimilarity::Similarity similarity, LoadedImage& image, OptimizationResult& knownResult)
+{
+	m_logger.trace(imagePath.data());
+
+	image.path = imagePath;
+	image.identity = m_resultCache ? ResultCache::Identify(imagePath) : std::nullopt;
+	image.knownHash = image.identity ? m_resultCache->FindContentHash(*image.identity) : std::nullopt;
+
+	if (image.knownHash && findCachedResult(*image.knownHash, similarity, imagePath, knownResult))
+	{
+		m_logger.trace("Unchanged since last run, skipped");
+
+		return true;
+	}
+
+	return false;
+}
+
+bool ImageOptimizer::findKnownContent(LoadedImage& image, ImageSimilarity::Similarity similarity, OptimizationResult& knownResult)
+{
+	if (!m_resultCache)
+	{
+		return false;
+	}
+
+	// The metadata matched, the content is the one hashed before and its result was looked up already
+	if (image.knownHash)
+	{
+		image.contentHash = *image.knownHash;
+
+		return false;
+	}
+
+	image.contentHash = xxhash::hash64(image.data.Data(), image.data.Size());
+
+	if (image.identity)
+	{
+		m_resultCache->AddFile(*image.identity, image.contentHash);
+	}
+
+	if (findCachedResult(image.contentHash, similarity, image.path, knownResult))
+	{
+		m_logger.trace("Already optimized, skipped");
+
+		return true;
+	}
+
+	return false;
+}
+
+// A result only stands when its output is there for this run, earlier ones may have written elsewhere or in place.
+// In place the file itself has to be at the target already, otherwise an output of the image has to be where this
+// run writes them, unless the image is such an output itself
+bool ImageOptimizer::findCachedResult(uint64_t contentHash, ImageSimilarity::Similarity similarity, const std::string& imagePath, OptimizationResult& knownResult)
+{
+	auto cached = m_resultCache->Find(contentHash, similarity);
+
+	if (!cached)
+	{
+		return false;
+	}
+
+	const bool atTarget = cached->quality == 0;
+	const bool hasOutput = m_inPlace ? atTarget : (m_outputNames->HasOutput(outputLocation(imagePath)) || (atTarget && m_outputNames->IsOutput(imagePath)));
+
+	if (!hasOutput)
+	{
+		m_logger.trace("Known result without an output for this run, optimized again");
+
+		return false;
+	}
+
+	knownResult = cached->result;
+
+	return true;
+}
+
+void ImageOptimizer::encodeImage(LoadedImage& image, ImageSimilarity::Similarity similarity, unsigned int parallelProbes, EncodedImage& encoded)
+{
+	encoded.path = image.path;
+	encoded.contentHash = image.contentHash;
+	encoded.originalSize = image.data.Size();
+
+	// Qualities above the one the file was saved at only add bytes
+	const auto sourceQuality = jpeg::estimate_quality(image.data.Data(), image.data.Size());
+
+	QualityRange searchRange{ MINIMUM_QUALITY, (sourceQuality != 0) ? std::min(sourceQuality, MAXIMUM_QUALITY) : MAXIMUM_QUALITY };
+
+	if (searchRange.GetMaximum() <= searchRange.GetMinimum())
+	{
+		m_logger.trace("Estimated quality " + std::to_string(sourceQuality) + ", couldn't compress more");
+
+		return;
+	}
+
+	auto& codec = jpeg::thread_codec();
+
+	// Decoded planes without color conversion where the colorspace allows it, the search runs on the luma
+	// and the final encode reuses all of them
+	jpeg::PlanarImage planarImage;
+	jpeg::memory_decode_planar(image.data.Data(), image.data.Size(), planarImage, codec);
 
-	auto colorImage = jpeg::load_color(imagePath);
+	// The file itself isn't needed anymore, the pipeline may hold many images at this point
+	image.data = jpeg::FileData();
 
-	Image grayImage{ colorToGray(colorImage) };
+	Image grayImage;
+	jpeg::luma_plane(planarImage, grayImage);
 
 	validateImage(grayImage);
 
 	m_logger.trace("Target ssim: " + std::to_string(similarity.GetValue()));
 	
-	auto bestQuality = m_imageProcessor->OptimizeImage(grayImage, similarity);
-		
-	auto temporaryFilename(getSuffixedFilename(imagePath, "_tmp"));
+	encoded.quality = m_imageProcessor->OptimizeImage(grayImage, similarity, codec, searchRange, parallelProbes);
 
-	jpeg::save(colorImage, temporaryFilename, bestQuality);
+	jpeg::memory_encode_planar(planarImage, encoded.quality, encoded.data, codec);
+}
 
-	OptimizationResult result{ fs::file_size(imagePath) , fs::file_size(temporaryFilename) };
+// The sizes are the ones in memory, an output that wouldn't be smaller is never written
+OptimizationResult ImageOptimizer::writeImage(const EncodedImage& encoded, ImageSimilarity::Similarity similarity)
+{
+	if (!encoded.IsCompressed())
+	{
+		return keepImage(encoded, similarity);
+	}
 
-	logFileSizesAndCompression(result);
+	const auto location = outputLocation(encoded.path);
+
+	auto file = m_outputWriter->Create(location);
+
+	OutputWriter::WriteAll(file, encoded.data.Data(), encoded.data.Size());
+
+	return recordOutput(encoded, commitOutput(*m_outputWriter, *m_outputNames, file, location, m_inPlace), similarity);
+}
+
+// Writes the batch through the ring when there is one
+OptimizationResult ImageOptimizer::writeImages(IoRing* ring, const std::vector<EncodedImage>& images, ImageSimilarity::Similarity similarity)
+{
+	OptimizationResult result;
 
-	auto newFileName(getSuffixedFilename(imagePath, "_compressed"));
+	std::vector<const EncodedImage*> written;
+	std::vector<OutputWriter::PendingFile> files;
+	std::vector<IoRing::FileWrite> writes;
 
-	if (!result.IsCompressed())
+	for (const auto& image : images)
 	{
-		fs::remove(temporaryFilename);
+		if (ring == nullptr || !image.IsCompressed())
+		{
+			tryStage(image.path, [&]() { result += writeImage(image, similarity); });
+		}
+		else
+		{
+			OutputWriter::PendingFile file;
+
+			if (tryStage(image.path, [&]() { file = m_outputWriter->Create(outputLocation(image.path)); }))
+			{
+				writes.push_back({ file.Descriptor(), image.data.Data(), image.data.Size() });
+				files.push_back(std::move(file));
+				written.push_back(&image);
+			}
+		}
+	}
 
-		m_logger.trace("Couldn't compress more");
+	if (writes.empty())
+	{
+		return result;
+	}
 
-		fs::copy_file(imagePath, newFileName);
+	ring->WriteFiles(writes);
 
-		result = result.GetUncompressedResult();
+	for (size_t i = 0; i < writes.size(); i++)
+	{
+		const auto& image = *written[i];
+
+		tryStage(image.path, [&]() {
+			if (writes[i].error != 0)
+			{
+				throw std::runtime_error(std::string("Unable to write output: ") + std::strerror(writes[i].error));
+			}
+
+			result += recordOutput(image, commitOutput(*m_outputWriter, *m_outputNames, files[i], outputLocation(image.path), m_inPlace), similarity);
+		});
+	}
+
+	return result;
+}
+
+// The original becomes the output, for images that couldn't be compressed more
+OptimizationResult ImageOptimizer::keepImage(const EncodedImage& encoded, ImageSimilarity::Similarity similarity)
+{
+	if (encoded.quality != 0)
+	{
+		logFileSizesAndCompression(OptimizationResult{ encoded.originalSize, encoded.data.Size() });
+
+		m_logger.trace("Couldn't compress more");
+	}
+
+	if (m_inPlace)
+	{
+		// Nothing to write, the original stays where it is
+	}
+	else if (m_linkOriginals)
+	{
+		while (!m_outputWriter->LinkOriginal(encoded.path, m_outputNames->Next(outputLocation(encoded.path))))
+		{
+		}
 	}
 	else
 	{
-		rename(temporaryFilename.c_str(), newFileName.c_str());
+		const auto location = outputLocation(encoded.path);
+
+		auto file = m_outputWriter->CloneOriginal(encoded.path, location);
+
+		commitOutput(*m_outputWriter, *m_outputNames, file, location, false);
 	}
 
+	OptimizationResult result{ encoded.originalSize, encoded.originalSize };
+
+	cacheResult(encoded.contentHash, similarity, 0, result);
+
 	return result;
 }
 
+OptimizationResult ImageOptimizer::recordOutput(const EncodedImage& encoded, const std::string& outputPath, ImageSimilarity::Similarity similarity)
+{
+	OptimizationResult result{ encoded.originalSize, encoded.data.Size() };
+
+	logFileSizesAndCompression(result);
+
+	cacheResult(encoded.contentHash, similarity, encoded.quality, result);
+
+	// The output is at the target already, a later run over the same folder skips it too
+	if (m_resultCache)
+	{
+		const auto outputHash = xxhash::hash64(encoded.data.Data(), encoded.data.Size());
+
+		cacheResult(outputHash, similarity, 0, OptimizationResult{ result.GetCompressedSize(), result.GetCompressedSize() });
+
+		if (auto outputIdentity = ResultCache::Identify(outputPath))
+		{
+			m_resultCache->AddFile(*outputIdentity, outputHash);
+		}
+	}
+
+	return result;
+}
+
+void ImageOptimizer::cacheResult(uint64_t contentHash, ImageSimilarity::Similarity similarity, unsigned int quality, const OptimizationResult& result)
+{
+	if (m_resultCache)
+	{
+		m_resultCache->Add(contentHash, similarity, { quality, result });
+	}
+}
+
 Image ImageOptimizer::loadImage(const std::string& imagePath)
 {
 	validateImagePath(imagePath);
 
-	return jpeg::load_grayscale(imagePath);
+	return jpeg::load_grayscale(imagePath, jpeg::thread_codec());
 }
 
 void ImageOptimizer::validateFolderPath(const std::string& imageFolderPath)
@@ -218,28 +878,6 @@ void ImageOptimizer::handleInvalidArgument(const char* message)
 	throw std::invalid_argument(message);
 }
 
-std::string ImageOptimizer::addSuffixToFileName(const std::string& filename, const std::string& suffix)
-{
-	fs::path p(filename);
-
-	fs::path newFilename = p.parent_path() / fs::path(p.stem().string() + suffix + p.extension().string());
-
-	return newFilename.string();
-}
-
-std::string ImageOptimizer::getSuffixedFilename(const std::string& filename, const std::string& suffix)
-{
-	for (unsigned long long counter = 0; ; counter++)
-	{
-		auto temporaryFileName = addSuffixToFileName(filename, suffix + std::to_string(counter));
-
-		if (!fs::exists(temporaryFileName))
-		{
-			return temporaryFileName;
-		}
-	}
-}
-
 bool ImageOptimizer::isJpegFile(const fs::directory_entry& file)
 {
 	if (!fs::is_regular_file(file))
@@ -261,32 +899,30 @@ void ImageOptimizer::logFileSizesAndCompression(OptimizationResult optimizationR
 				" Compression: " + std::to_string(compression) + "%");
 }
 
+// Largest files first, so the batch doesn't end waiting on a big one picked up last. The size comes with the
+// listing, the files themselves are left alone until the result cache has had its say
 std::vector<std::string> ImageOptimizer::getJpegInFolder(const std::string& imageFolderPath)
 {
-	std::vector<std::string> filenames;
+	std::vector<std::pair<filesize_t, std::string>> images;
 
 	for (auto& file : fs::directory_iterator(fs::path(imageFolderPath)))
 	{
 		if (isJpegFile(file))
 		{
-			filenames.push_back(file.path().string());
+			std::error_code error;
+			images.emplace_back(file.file_size(error), file.path().string());
 		}
 	}
 
-	return filenames;
-}
+	std::stable_sort(images.begin(), images.end(), [](const auto& first, const auto& second) {return first.first > second.first; });
 
-std::vector<std::string> ImageOptimizer::getAllFoldersInFolder(const std::string& folderPath)
-{
-	std::vector<std::string> folders;
+	std::vector<std::string> filenames;
+	filenames.reserve(images.size());
 
-	for (auto& file : fs::recursive_directory_iterator(fs::path(folderPath)))
+	for (auto& image : images)
 	{
-		if (is_directory(file))
-		{
-			folders.push_back(file.path().string());
-		}
+		filenames.push_back(std::move(image.second));
 	}
 
-	return folders;
+	return filenames;
 }
@@ -4,64 +4,240 @@
 #include "iopt/image_similarity.hpp"
 #include "jpeg.hpp"
 #include "optimization_sequence.hpp"
+#include "thread_pool.hpp"
 
 #include "iopt/image.hpp"
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <cassert>
+#include <cstdint>
+#include <future>
 #include <sstream>
+#include <utility>
 
+namespace {
+	// Probe buffers of the calling thread, kept between tasks so parallel probes on the pool only allocate on the first one
+	struct ProbeBuffers {
+		jpeg::Buffer compressed;
+		Image decompressed;
+	};
 
-ImageProcessor::ImageProcessor(Logger& logger) :
-	m_logger(logger)
+	ProbeBuffers& thread_probe_buffers()
+	{
+		thread_local ProbeBuffers buffers;
+
+		return buffers;
+	}
+}
+
+ImageProcessor::ImageProcessor(Logger& logger, ThreadPool& threadPool) :
+	m_logger(logger),
+	m_threadPool(threadPool)
 {
 }
 
-Quality ImageProcessor::OptimizeImage(const Image& image, sim::Similarity targetSimilarity)
+void ImageProcessor::SetSearchStrategy(SearchStrategy searchStrategy)
+{
+	m_searchStrategy = searchStrategy;
+}
+
+void ImageProcessor::SetSsimConfidence(double confidence)
+{
+	m_ssimConfidence = confidence;
+}
+
+void ImageProcessor::SetSearchProxy(SearchProxy searchProxy)
+{
+	m_searchProxy = searchProxy;
+}
+
+Quality ImageProcessor::OptimizeImage(const Image& image, sim::Similarity targetSimilarity, jpeg::Codec& codec, QualityRange searchRange, unsigned int parallelProbes)
 {
 	auto start = std::chrono::steady_clock::now();
 
-	auto qualities = searchBestQuality(image, targetSimilarity);
+	Image proxy;
+	const bool proxied = makeProxy(image, proxy);
+
+	auto qualities = proxied ?
+		verifyOnFullImage(image, targetSimilarity, codec, searchRange, searchBestQuality(proxy, targetSimilarity, codec, searchRange, parallelProbes).BestQuality(), parallelProbes) :
+		searchBestQuality(image, targetSimilarity, codec, searchRange, parallelProbes);
+
+	if (!proxied)
+	{
+		resolveBracket(image, qualities, codec);
+	}
 
 	auto finish = std::chrono::steady_clock::now();
 	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count();
 
-	logDurationAndResults(duration, qualities);
+	// A proxy estimate has to be verified: the closest ssim could be a probe just below the target
+	const auto quality = proxied ? qualities.LowestQualityAboveTarget() : qualities.BestQuality();
+
+	logDurationAndResults(duration, qualities, quality);
+
+	return quality;
+}
+
+OptimizationSequence ImageProcessor::searchBestQuality(const Image& image, sim::Similarity targetSsim, jpeg::Codec& codec, QualityRange searchRange, unsigned int parallelProbes)
+{
+	return (parallelProbes > 1) ? parallelSearchBestQuality(image, targetSsim, searchRange, parallelProbes) : SearchBestQuality(image, targetSsim, codec, m_searchStrategy, searchRange, m_ssimConfidence);
+}
+
+// The estimate from the proxy is encoded at full size, then one more probe is placed where the full size ssim predicts the target.
+// When both are above the target the lower one is kept, otherwise the search goes on at full size between them
+OptimizationSequence ImageProcessor::verifyOnFullImage(const Image& image, sim::Similarity targetSsim, jpeg::Codec& codec, QualityRange searchRange, Quality estimate, unsigned int parallelProbes)
+{
+	OptimizationSequence qualities{ targetSsim };
+
+	jpeg::Buffer compressed;
+	Image decompressed;
+
+	auto ssim = computeSsim(image, estimate, targetSsim, m_ssimConfidence, codec, compressed, decompressed);
+	qualities.AddOptimizationResult(estimate, ssim.similarity, ssim.exact);
+
+	auto qualityRange = getNextQualityRange(estimate, ssim.similarity, targetSsim, searchRange);
+	bool verified = ssim.similarity > targetSsim;
+
+	auto prediction = getInterpolatedQuality(qualityRange, qualities, targetSsim);
+
+	if (!qualities.HasBeenTried(prediction))
+	{
+		auto predictedSsim = computeSsim(image, prediction, targetSsim, m_ssimConfidence, codec, compressed, decompressed);
+		qualities.AddOptimizationResult(prediction, predictedSsim.similarity, predictedSsim.exact);
+
+		qualityRange = getNextQualityRange(prediction, predictedSsim.similarity, targetSsim, qualityRange);
+		verified = verified && predictedSsim.similarity > targetSsim;
+	}
+
+	if (!verified)
+	{
+		auto results = searchBestQuality(image, targetSsim, codec, qualityRange, parallelProbes);
+
+		for (const auto& result : results)
+		{
+			if (!qualities.HasBeenTried(result.first))
+			{
+				qualities.AddOptimizationResult(result.first, result.second, results.IsExact(result.first));
+			}
+		}
+	}
 
-	return qualities.BestQuality();
+	return qualities;
 }
 
-OptimizationSequence ImageProcessor::searchBestQuality(const Image& image, sim::Similarity targetSsim)
+OptimizationSequence ImageProcessor::SearchBestQuality(const Image& image, sim::Similarity targetSsim, jpeg::Codec& codec, SearchStrategy searchStrategy, QualityRange searchRange, double ssimConfidence)
 {
-	QualityRange qualityRange{ 50, 100 };
+	QualityRange qualityRange{ searchRange };
 
 	OptimizationSequence qualities{ targetSsim };
 
+	// Reused by every probe, only the first one allocates
+	jpeg::Buffer compressed;
+	Image decompressed;
+
 	auto quality = getNextQuality(qualityRange);
+	bool interpolated = false;
 
 	while (!qualities.HasBeenTried(quality))
 	{
-		auto ssim = computeSsim(image, quality);
+		auto ssim = computeSsim(image, quality, targetSsim, ssimConfidence, codec, compressed, decompressed);
+
+		qualities.AddOptimizationResult(quality, ssim.similarity, ssim.exact);
+
+		const auto previousWidth = qualityRange.GetMaximum() - qualityRange.GetMinimum();
+
+		qualityRange = getNextQualityRange(quality, ssim.similarity, targetSsim, qualityRange);
+
+		// An interpolation step that didn't halve the range is followed by a bisection step, so convergence is never slower than bisection
+		const bool stalled = interpolated && 2 * (qualityRange.GetMaximum() - qualityRange.GetMinimum()) > previousWidth;
+
+		interpolated = (searchStrategy == SearchStrategy::Interpolation) && !stalled;
+
+		quality = interpolated ? getInterpolatedQuality(qualityRange, qualities, targetSsim) : getNextQuality(qualityRange);
+	}
+
+	return qualities;
+}
+
+// k-ary search: the range is split by parallelProbes qualities evaluated together, the next range
+// is the interval between the two probes around the target
+OptimizationSequence ImageProcessor::parallelSearchBestQuality(const Image& image, sim::Similarity targetSsim, QualityRange searchRange, unsigned int parallelProbes)
+{
+	QualityRange qualityRange{ searchRange };
+
+	OptimizationSequence qualities{ targetSsim };
+
+	auto candidates = getNextQualities(qualityRange, parallelProbes, qualities);
+
+	while (!candidates.empty())
+	{
+		std::vector<std::future<sim::SsimEstimate>> futures;
+		futures.reserve(candidates.size());
+
+		for (auto quality : candidates)
+		{
+			futures.push_back(m_threadPool.Submit([&image, quality, targetSsim, ssimConfidence = m_ssimConfidence]() {
+				auto& buffers = thread_probe_buffers();
+
+				return computeSsim(image, quality, targetSsim, ssimConfidence, jpeg::thread_codec(), buffers.compressed, buffers.decompressed);
+			}));
+		}
 
-		qualities.AddOptimizationResult(quality, ssim);
+		for (size_t i = 0; i < candidates.size(); i++)
+		{
+			auto ssim = m_threadPool.Wait(futures[i]);
 
-		qualityRange = getNextQualityRange(quality, ssim, targetSsim, qualityRange);
+			qualities.AddOptimizationResult(candidates[i], ssim.similarity, ssim.exact);
 
-		quality = getNextQuality(qualityRange);
+			qualityRange = getNextQualityRange(candidates[i], ssim.similarity, targetSsim, qualityRange);
+		}
+
+		candidates = getNextQualities(qualityRange, parallelProbes, qualities);
 	}
 
 	return qualities;
 }
 
-ImageSimilarity::Similarity ImageProcessor::computeSsim(const Image& image, Quality quality)
+// The search only needs to know on which side of the target each probe is, probes far from it stop early
+ImageSimilarity::SsimEstimate ImageProcessor::computeSsim(const Image& image, Quality quality, sim::Similarity targetSsim, double ssimConfidence, jpeg::Codec& codec, jpeg::Buffer& compressed, Image& decompressed)
 {
-	std::vector<uint8_t> buffer = jpeg::memory_encode_grayscale(image, quality);
+	encodeAndDecode(image, quality, codec, compressed, decompressed);
+
+	return ImageSimilarity::ComputeSsim(image, decompressed, targetSsim, ssimConfidence);
+}
 
-	auto compressedImage = jpeg::memory_decode_grayscale(buffer);
+void ImageProcessor::encodeAndDecode(const Image& image, Quality quality, jpeg::Codec& codec, jpeg::Buffer& compressed, Image& decompressed)
+{
+	jpeg::memory_encode_grayscale(image, quality, compressed, codec);
 
-	assert(compressedImage.data.size());
+	jpeg::memory_decode_grayscale(compressed.Data(), compressed.Size(), decompressed, codec);
 
-	return ImageSimilarity::ComputeSsim(image, compressedImage);
+	assert(decompressed.data.size());
+}
+
+// With a monotone ssim the closest one to the target is at an end of the bracket, the ends that stopped early
+// are compared again on the whole image so the best quality isn't picked on an estimate
+void ImageProcessor::resolveBracket(const Image& image, OptimizationSequence& qualities, jpeg::Codec& codec)
+{
+	const auto bracket = qualities.Bracket();
+
+	auto& buffers = thread_probe_buffers();
+
+	for (auto end : { bracket.first, bracket.second })
+	{
+		if (end == qualities.end() || qualities.IsExact(end->first))
+		{
+			continue;
+		}
+
+		const Quality quality = end->first;
+
+		encodeAndDecode(image, quality, codec, buffers.compressed, buffers.decompressed);
+
+		qualities.ReplaceEstimate(quality, ImageSimilarity::ComputeSsim(image, buffers.decompressed));
+	}
 }
 
 Quality ImageProcessor::getNextQuality(QualityRange qualityRange)
@@ -69,16 +245,222 @@ Quality ImageProcessor::getNextQuality(QualityRange qualityRange)
 	return (qualityRange.GetMinimum() + qualityRange.GetMaximum()) / 2;
 }
 
+// Distortion grows roughly with the square of the quantization step, which is linear in (100 - quality) above 50,
+// so sqrt(1 - ssim) is close to linear in the quality: interpolate there, between the tried qualities bounding the range.
+// The maximum quality is taken as (nearly) lossless when it hasn't been tried.
+Quality ImageProcessor::getInterpolatedQuality(QualityRange qualityRange, const OptimizationSequence& qualities, sim::Similarity targetSsim)
+{
+	const auto minimum = qualityRange.GetMinimum();
+	const auto maximum = qualityRange.GetMaximum();
+
+	if (maximum < minimum + 2)
+	{
+		return getNextQuality(qualityRange);
+	}
+
+	auto distortion = [](sim::Similarity ssim) { return std::sqrt(std::max(0.0, 1.0 - ssim.GetValue())); };
+
+	// Estimates from an early stop are only on the right side of the target, too far off to interpolate with
+	const auto exact = [&qualities](Quality quality) {
+		const auto result = qualities.Find(quality);
+
+		return (result != qualities.end() && qualities.IsExact(quality)) ? result : qualities.end();
+	};
+
+	const auto lower = exact(minimum);
+	const auto upper = exact(maximum);
+
+	const bool upperKnown = (upper != qualities.end()) || (maximum == MAXIMUM_QUALITY);
+	const double upperDistortion = (upper != qualities.end()) ? distortion(upper->second) : 0.0;
+	const double targetDistortion = distortion(targetSsim);
+
+	double estimate;
+
+	if (lower != qualities.end() && upperKnown && distortion(lower->second) > upperDistortion)
+	{
+		const double lowerDistortion = distortion(lower->second);
+
+		estimate = minimum + (lowerDistortion - targetDistortion) * (maximum - minimum) / (lowerDistortion - upperDistortion);
+	}
+	else if (upper != qualities.end() && maximum < MAXIMUM_QUALITY && upperDistortion > 0.0)
+	{
+		// Only the upper end is measured, extrapolate towards lossless
+		estimate = MAXIMUM_QUALITY - targetDistortion * (MAXIMUM_QUALITY - maximum) / upperDistortion;
+	}
+	else
+	{
+		return getNextQuality(qualityRange);
+	}
+
+	// Strictly inside the range, so every step tries a new quality and shrinks the range
+	const double clamped = std::min<double>(maximum - 1, std::max<double>(minimum + 1, std::round(estimate)));
+
+	return static_cast<Quality>(clamped);
+}
+
+// Evenly spaced inside the range, with a single quality this is the bisection midpoint
+std::vector<Quality> ImageProcessor::getNextQualities(QualityRange qualityRange, unsigned int count, const OptimizationSequence& qualities)
+{
+	std::vector<Quality> candidates;
+
+	// Crossed ends mean the ssim wasn't monotone around the target, nothing left to search
+	if (qualityRange.GetMaximum() < qualityRange.GetMinimum())
+	{
+		return candidates;
+	}
+
+	const auto minimum = qualityRange.GetMinimum();
+	const auto width = qualityRange.GetMaximum() - minimum;
+
+	for (unsigned int i = 1; i <= count; i++)
+	{
+		Quality quality = minimum + (width * i) / (count + 1);
+
+		if (!qualities.HasBeenTried(quality) && std::find(candidates.begin(), candidates.end(), quality) == candidates.end())
+		{
+			candidates.push_back(quality);
+		}
+	}
+
+	return candidates;
+}
+
+// Never widens the range, so results of a parallel step can be applied in any order
 QualityRange ImageProcessor::getNextQualityRange(Quality quality, sim::Similarity currentSsim, sim::Similarity targetSsim, QualityRange qualityRange)
 {
-	return (currentSsim > targetSsim) ? QualityRange{ qualityRange.GetMinimum(), quality } : QualityRange{ quality, qualityRange.GetMaximum() };
+	return (currentSsim > targetSsim) ? QualityRange{ qualityRange.GetMinimum(), std::min(quality, qualityRange.GetMaximum()) } : QualityRange{ std::max(quality, qualityRange.GetMinimum()), qualityRange.GetMaximum() };
+}
+
+bool ImageProcessor::makeProxy(const Image& image, Image& proxy) const
+{
+	switch (m_searchProxy)
+	{
+	case SearchProxy::Downscaled:
+		if (static_cast<unsigned int>(std::min(image.width, image.height)) < s_proxyScale * s_minimumProxySide)
+		{
+			return false;
+		}
+
+		downscale(image, s_proxyScale, proxy);
+		return true;
+
+	case SearchProxy::Tiles:
+		return sampleTiles(image, s_proxyScale, proxy);
+
+	default:
+		return false;
+	}
+}
+
+// Box filter, the last partial rows and columns are dropped
+void ImageProcessor::downscale(const Image& image, unsigned int factor, Image& output)
+{
+	output.width = image.width / factor;
+	output.height = image.height / factor;
+	output.data.resize(static_cast<size_t>(output.width) * output.height);
+
+	std::vector<unsigned int> columnSums(output.width);
+
+	for (int y = 0; y < output.height; y++)
+	{
+		std::fill(columnSums.begin(), columnSums.end(), 0u);
+
+		for (unsigned int row = 0; row < factor; row++)
+		{
+			const unsigned char* line = &image.data[(static_cast<size_t>(y) * factor + row) * image.width];
+
+			for (int x = 0; x < output.width; x++)
+			{
+				for (unsigned int column = 0; column < factor; column++)
+				{
+					columnSums[x] += line[x * factor + column];
+				}
+			}
+		}
+
+		for (int x = 0; x < output.width; x++)
+		{
+			output.data[static_cast<size_t>(y) * output.width + x] = static_cast<unsigned char>((columnSums[x] + factor * factor / 2) / (factor * factor));
+		}
+	}
+}
+
+// One tile in factor^2 is kept, picked at evenly spaced ranks of variance so flat and detailed areas
+// weigh in the mosaic like they do in the image. Tiles are laid out at multiples of their size, keeping them block aligned
+bool ImageProcessor::sampleTiles(const Image& image, unsigned int factor, Image& mosaic)
+{
+	const unsigned int tilesX = image.width / s_tileSize;
+	const unsigned int tilesY = image.height / s_tileSize;
+	const unsigned int tiles = tilesX * tilesY;
+
+	const unsigned int columns = static_cast<unsigned int>(std::sqrt(static_cast<double>(tiles / (factor * factor))));
+	const unsigned int rows = (columns > 0) ? (tiles / (factor * factor)) / columns : 0;
+
+	if (columns * s_tileSize < s_minimumProxySide || rows * s_tileSize < s_minimumProxySide)
+	{
+		return false;
+	}
+
+	std::vector<std::pair<double, unsigned int>> variances;
+	variances.reserve(tiles);
+
+	for (unsigned int tile = 0; tile < tiles; tile++)
+	{
+		const unsigned char* origin = &image.data[(static_cast<size_t>(tile / tilesX) * image.width + tile % tilesX) * s_tileSize];
+
+		uint64_t sum = 0;
+		uint64_t squaredSum = 0;
+
+		for (unsigned int y = 0; y < s_tileSize; y++)
+		{
+			const unsigned char* line = origin + static_cast<size_t>(y) * image.width;
+
+			for (unsigned int x = 0; x < s_tileSize; x++)
+			{
+				sum += line[x];
+				squaredSum += line[x] * line[x];
+			}
+		}
+
+		const double pixels = s_tileSize * s_tileSize;
+		const double mean = sum / pixels;
+
+		variances.emplace_back(squaredSum / pixels - mean * mean, tile);
+	}
+
+	std::sort(variances.begin(), variances.end());
+
+	const unsigned int sampled = columns * rows;
+
+	mosaic.width = columns * s_tileSize;
+	mosaic.height = rows * s_tileSize;
+	mosaic.data.resize(static_cast<size_t>(mosaic.width) * mosaic.height);
+
+	for (unsigned int i = 0; i < sampled; i++)
+	{
+		// Middle of the i-th of sampled equal slices of the ranking
+		const unsigned int tile = variances[(2 * static_cast<size_t>(i) + 1) * tiles / (2 * sampled)].second;
+
+		const unsigned char* source = &image.data[(static_cast<size_t>(tile / tilesX) * image.width + tile % tilesX) * s_tileSize];
+		unsigned char* destination = &mosaic.data[(static_cast<size_t>(i / columns) * mosaic.width + i % columns) * s_tileSize];
+
+		for (unsigned int y = 0; y < s_tileSize; y++)
+		{
+			std::copy(source, source + s_tileSize, destination);
+
+			source += image.width;
+			destination += mosaic.width;
+		}
+	}
+
+	return true;
 }
 
-void ImageProcessor::logDurationAndResults(long long duration, const OptimizationSequence& results)
+void ImageProcessor::logDurationAndResults(long long duration, const OptimizationSequence& results, Quality quality)
 {
 	std::ostringstream message;
 
-	message << duration << "ms - " << results.NumberOfIterations() << " iterations - Best quality: " << results.BestQuality() << std::endl;	
+	message << duration << "ms - " << results.NumberOfIterations() << " iterations - Best quality: " << quality << std::endl;	
 
 	for (auto result : results)
 	{
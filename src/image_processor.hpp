@@ -1,32 +1,77 @@
 #pragma once
 
 #include "iopt/logger.hpp"
+#include "iopt/search_strategy.hpp"
 #include "quality.hpp"
 
+#include <vector>
+
 namespace ImageSimilarity
 {
 	class Similarity;
+	struct SsimEstimate;
 }
 
 namespace sim = ImageSimilarity;
 
+namespace jpeg
+{
+	class Codec;
+	class Buffer;
+}
+
 class OptimizationSequence;
+class ThreadPool;
 struct Image;
 
 class  ImageProcessor
 {
 public:
-	ImageProcessor(Logger& logger);
-	Quality OptimizeImage(const Image& image, sim::Similarity targetSimilarity);
+	ImageProcessor(Logger& logger, ThreadPool& threadPool);
+
+	// Applies to the sequential search, parallel steps always split the range evenly
+	void SetSearchStrategy(SearchStrategy searchStrategy);
+
+	// Probes stop comparing once their ssim is on one side of the target with this confidence
+	void SetSsimConfidence(double confidence);
+
+	void SetSearchProxy(SearchProxy searchProxy);
+
+	// With parallelProbes > 1 each search step evaluates that many qualities at once on the pool
+	Quality OptimizeImage(const Image& image, sim::Similarity targetSimilarity, jpeg::Codec& codec, QualityRange searchRange, unsigned int parallelProbes = 1);
+
+	static OptimizationSequence SearchBestQuality(const Image& image, sim::Similarity targetSsim, jpeg::Codec& codec, SearchStrategy searchStrategy, QualityRange searchRange = { MINIMUM_QUALITY, MAXIMUM_QUALITY }, double ssimConfidence = 1.0);
 	
 private:
-	static OptimizationSequence searchBestQuality(const Image& image, sim::Similarity targetSsim);
-	static sim::Similarity computeSsim(const Image& image, Quality quality);
+	OptimizationSequence searchBestQuality(const Image& image, sim::Similarity targetSsim, jpeg::Codec& codec, QualityRange searchRange, unsigned int parallelProbes);
+	OptimizationSequence verifyOnFullImage(const Image& image, sim::Similarity targetSsim, jpeg::Codec& codec, QualityRange searchRange, Quality estimate, unsigned int parallelProbes);
+	OptimizationSequence parallelSearchBestQuality(const Image& image, sim::Similarity targetSsim, QualityRange searchRange, unsigned int parallelProbes);
+	static sim::SsimEstimate computeSsim(const Image& image, Quality quality, sim::Similarity targetSsim, double ssimConfidence, jpeg::Codec& codec, jpeg::Buffer& compressed, Image& decompressed);
+	static void encodeAndDecode(const Image& image, Quality quality, jpeg::Codec& codec, jpeg::Buffer& compressed, Image& decompressed);
+	static void resolveBracket(const Image& image, OptimizationSequence& qualities, jpeg::Codec& codec);
+
+	bool makeProxy(const Image& image, Image& proxy) const;
+	static void downscale(const Image& image, unsigned int factor, Image& output);
+	static bool sampleTiles(const Image& image, unsigned int factor, Image& mosaic);
 
 	static Quality getNextQuality(QualityRange qualityRange);
+	static Quality getInterpolatedQuality(QualityRange qualityRange, const OptimizationSequence& qualities, sim::Similarity targetSsim);
+	static std::vector<Quality> getNextQualities(QualityRange qualityRange, unsigned int count, const OptimizationSequence& qualities);
 	static QualityRange getNextQualityRange(Quality quality, sim::Similarity currentSsim, sim::Similarity targetSsim, QualityRange currentRange);
 
-	void logDurationAndResults(long long duration, const OptimizationSequence& results);
+	void logDurationAndResults(long long duration, const OptimizationSequence& results, Quality quality);
 
 	Logger& m_logger;
+	ThreadPool& m_threadPool;
+	SearchStrategy m_searchStrategy = SearchStrategy::Bisection;
+	double m_ssimConfidence = 1.0;
+	SearchProxy m_searchProxy = SearchProxy::None;
+
+	static constexpr unsigned int s_proxyScale = 4;
+
+	// Below this the decimated ssim of the proxy would be computed on too few pixels
+	static constexpr unsigned int s_minimumProxySide = 256;
+
+	// A multiple of the largest MCU, so the blocks of a tile are the ones it has in the full image
+	static constexpr unsigned int s_tileSize = 64;
 };
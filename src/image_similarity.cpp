@@ -1,8 +1,13 @@
 #include "iopt/image_similarity.hpp"
 
 #include "jpeg.hpp"
+#include "ssim_kernels.hpp"
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
 #include <tuple>
 #include <vector>
 #include <memory>
@@ -55,206 +60,382 @@ namespace ImageSimilarity
 
 	#define SQUARE_LEN 8
 
-	Size convolve(float *img, Size size, float *result)
+	// Scratch memory of the ssim computation, kept per thread so that repeated calls don't allocate
+	struct Workspace
 	{
-		int width = size.m_width;
-		unsigned int height = size.m_height;
-		unsigned int dst_w = width - SQUARE_LEN + 1;
-		unsigned int dst_h = height - SQUARE_LEN + 1;
-		float* dst = result ? result : img;
+		std::vector<unsigned int> referenceColumnSums;
+		std::vector<unsigned int> compareColumnSums;
 
-		double* boxes = new double[size.Total()];
+		std::vector<float> rows;
+		std::vector<float> band;
+		std::vector<double> running;
+		std::vector<float> windows;
 
-		boxes[0] = img[0];
-		for (int x = 1; x < width; x++)
+		std::vector<unsigned char> comparedBands;
+	};
+
+	Workspace& threadWorkspace()
+	{
+		thread_local Workspace workspace;
+
+		return workspace;
+	}
+
+	// assign only allocates when growing past the capacity
+	template <typename T>
+	T* prepare(std::vector<T>& buffer, size_t size, T value = T())
+	{
+		buffer.assign(size, value);
+
+		return buffer.data();
+	}
+
+	// Produces one row at a time of the image as float, box-decimated by the scaling factor
+	class RowSource
+	{
+	public:
+		RowSource(const uint8_t* image, Size size, unsigned int scaling, std::vector<unsigned int>& columnSums) :
+			m_image{ image }, m_width{ size.m_width }, m_scaling{ scaling }, m_scaledSize{ size / scaling },
+			m_columnSums{ columnSums }
 		{
-			boxes[x] = boxes[x-1] + img[x];
+			m_columnSums.resize(scaling > 1 ? m_scaledSize.m_width * scaling : 0);
 		}
 
-		for (unsigned int y = 1; y < height; y++)
+		Size GetSize() const { return m_scaledSize; }
+
+		void Read(unsigned int row, float* destination)
 		{
-			double* b = &boxes[y * width];
-			*b++ = boxes[(y - 1) * width] + img[y * width];
-			for (int x = 1; x < width; x++)
+			if (m_scaling == 1)
 			{
-				double val = b[-1] + b[-width] - b[-width - 1] + img[y * width + x];
-				*b++ = val;
+				kernels::Best().convertToFloat(m_image + row * m_width, destination, m_scaledSize.m_width);
+
+				return;
 			}
-		}
-			
- 		dst[0] = static_cast<float>(boxes[(SQUARE_LEN - 1) * width + SQUARE_LEN - 1]);
 
-		for (unsigned int x = 1; x < dst_w; x++)
-		{
-			dst[x] = static_cast<float>(boxes[(SQUARE_LEN - 1) * width + x + SQUARE_LEN - 1] - boxes[(SQUARE_LEN - 1) * width + x - 1]);
-		}
+			const float normalization = 1.0f / (m_scaling * m_scaling);
+			const uint8_t* firstRow = m_image + row * m_scaling * m_width;
+			const unsigned int usedWidth = m_scaledSize.m_width * m_scaling;
 
-		for (unsigned int y = 1; y < dst_h; ++y)
-		{
-			dst[y * dst_w] = static_cast<float>(boxes[(y + SQUARE_LEN - 1) * width + SQUARE_LEN - 1] - boxes[(y - 1) * width + SQUARE_LEN - 1]);
+			// Sum the rows of the block first, the inner loop is then contiguous
+			std::fill(m_columnSums.begin(), m_columnSums.end(), 0u);
 
-			for (unsigned int x = 1; x < dst_w; ++x)
+			for (unsigned int y = 0; y < m_scaling; y++)
 			{
-				double box_sum = boxes[(y + SQUARE_LEN - 1) * width + x - 1 + SQUARE_LEN]
-								- boxes[(y + SQUARE_LEN - 1) * width + x - 1]
-								- boxes[(y - 1) * width + x - 1 + SQUARE_LEN]
-								+ boxes[(y - 1) * width + x - 1];
+				const uint8_t* line = firstRow + y * m_width;
+				for (unsigned int x = 0; x < usedWidth; x++)
+				{
+					m_columnSums[x] += line[x];
+				}
+			}
+
+			const unsigned int* columnSums = m_columnSums.data();
 
-				dst[y*dst_w + x] = (float)box_sum;
+			for (unsigned int x = 0; x < m_scaledSize.m_width; x++)
+			{
+				unsigned int sum = 0;
+				for (unsigned int col = 0; col < m_scaling; col++)
+				{
+					sum += columnSums[col];
+				}
+
+				columnSums += m_scaling;
+
+				destination[x] = sum * normalization;
 			}
 		}
 
-		delete[] boxes;
+	private:
+		const uint8_t* m_image;
+		unsigned int m_width;
+		unsigned int m_scaling;
+		Size m_scaledSize;
+		std::vector<unsigned int>& m_columnSums;
+	};
+
+	// Sums of SQUARE_LEN consecutive values, summing directly instead of sliding so rounding errors don't build up along the row
+	void horizontalWindowSums(const float* row, float* sums, unsigned int count)
+	{
+		std::copy(row, row + count, sums);
 
-		return{ dst_w , dst_h };
+		for (unsigned int offset = 1; offset < SQUARE_LEN; offset++)
+		{
+			const float* shifted = row + offset;
+			for (unsigned int x = 0; x < count; x++)
+			{
+				sums[x] += shifted[x];
+			}
+		}
 	}
-	
-	std::pair<std::unique_ptr<float[]>, Size> decimate(const uint8_t* image, Size size, unsigned int scaling) {
+
+	// Single pass over the rows: the window sums of the five statistics are kept for the last SQUARE_LEN rows only,
+	// so memory is O(width) instead of five full size planes plus a summed area table each.
+	// Returns the sum of the ssim of the windows whose top row is in [firstWindow, firstWindow + windowRows)
+	double ssim(RowSource& ref, RowSource& cmp, unsigned int firstWindow, unsigned int windowRows)
+	{
+		constexpr unsigned int STATISTICS = 5;
+
+		const auto& simd = kernels::Best();
+
+		const Size size = ref.GetSize();
 		const unsigned int width = size.m_width;
-		Size scaledSize = size / scaling;
-		const Size efectiveSize = scaledSize * scaling;
+		const unsigned int dst_w = width - SQUARE_LEN + 1;
+
+		auto& workspace = threadWorkspace();
 
-		auto destination = std::make_unique<float[]>(scaledSize.Total());
-		auto destinationPointer = destination.get();
+		// ref, cmp, ref^2, cmp^2, ref*cmp of the current row
+		float* rows = prepare(workspace.rows, STATISTICS * width);
+		float* row[STATISTICS];
 
-		const float normalization = 1.0f / (scaling * scaling);
+		// Horizontal window sums of the last SQUARE_LEN rows, per statistic
+		float* band = prepare(workspace.band, STATISTICS * SQUARE_LEN * dst_w);
 
-		for (unsigned int y = 0; y < efectiveSize.m_height; y += scaling)
+		// Running vertical sums of the band, in double so adding and removing rows doesn't drift
+		double* running = prepare(workspace.running, STATISTICS * dst_w, 0.0);
+		float* windows = prepare(workspace.windows, STATISTICS * dst_w);
+		float* window[STATISTICS];
+
+		for (unsigned int statistic = 0; statistic < STATISTICS; statistic++)
 		{
-			for (unsigned int x = 0; x < efectiveSize.m_width; x += scaling)
+			row[statistic] = &rows[statistic * width];
+			window[statistic] = &windows[statistic * dst_w];
+		}
+
+		const float norm = 1.0f / (SQUARE_LEN * SQUARE_LEN);
+		double ssim_sum = 0.0;
+
+		for (unsigned int y = 0; y < windowRows + SQUARE_LEN - 1; y++)
+		{
+			ref.Read(firstWindow + y, row[0]);
+			cmp.Read(firstWindow + y, row[1]);
+
+			simd.products(row[0], row[1], row[2], row[3], row[4], width);
+
+			const unsigned int slot = y % SQUARE_LEN;
+
+			for (unsigned int statistic = 0; statistic < STATISTICS; statistic++)
 			{
-				unsigned int sum = 0;
-				for (unsigned int row = 0; row < scaling; row++) // unroll agambini
+				float* newest = &band[(statistic * SQUARE_LEN + slot) * dst_w];
+				double* vertical = &running[statistic * dst_w];
+
+				if (y >= SQUARE_LEN)
 				{
-					const uint8_t* curr_img = image + (y + row) * width + x;
-					for (unsigned int col = 0; col < scaling; col++)
+					// The slot still holds the row leaving the window
+					for (unsigned int x = 0; x < dst_w; x++)
 					{
-						sum += curr_img[col];
+						vertical[x] -= newest[x];
 					}
 				}
 
-				*destinationPointer++ = sum * normalization;
+				horizontalWindowSums(row[statistic], newest, dst_w);
+
+				for (unsigned int x = 0; x < dst_w; x++)
+				{
+					vertical[x] += newest[x];
+					window[statistic][x] = static_cast<float>(vertical[x]);
+				}
+			}
+
+			if (y >= SQUARE_LEN - 1)
+			{
+				ssim_sum += simd.ssimSum(window[0], window[1], window[2], window[3], window[4], dst_w, norm);
 			}
 		}
 
-		return{ std::move(destination), std::move(scaledSize) };
+		return ssim_sum;
+	}
+
+	// As recommended with the original ssim, images are downsampled so that their shorter side is about 256 pixels
+	int computeScale(Size size)
+	{
+		return std::max(1, (int)(std::min(size.m_width, size.m_height) / 256.0f + 0.5f));
 	}
 
-	float ssim(float *ref, float *cmp, Size size)
+	// Calls function with the band sum of the decimated images and their number of windows
+	template <typename Function>
+	auto withBandSum(const Image& referenceImage, const Image& compareImage, Function&& function)
 	{
-		unsigned int totalSize = size.Total();
-
-		float* ref_mu = new float[totalSize];
-		float* cmp_mu = new float[totalSize];
-		float* ref_sigma_sqd = new float[totalSize];
-		float* cmp_sigma_sqd = new float[totalSize];
-		float* sigma_both = new float[totalSize];
-
-		/* Calculate mean */
-		convolve(ref, size, ref_mu);
-		convolve(cmp, size, cmp_mu);
-		
-		for (unsigned int offset = 0; offset < totalSize; offset++)
+		if (referenceImage.width != compareImage.width || referenceImage.height != compareImage.height)
 		{
-			ref_sigma_sqd[offset] = ref[offset] * ref[offset];
-			cmp_sigma_sqd[offset] = cmp[offset] * cmp[offset];
-			sigma_both[offset] = ref[offset] * cmp[offset];
+			throw std::invalid_argument("Images must be same size");
 		}
 
-		/* Calculate sigma */
-		convolve(ref_sigma_sqd, size, 0);
-		convolve(cmp_sigma_sqd, size, 0);
-		size = convolve(sigma_both, size, 0);
+		Size size = ImageSize(referenceImage);
 
-		totalSize = size.Total();
+		int scale = computeScale(size);
 
-		constexpr int L = 255;
-		constexpr float K1 = 0.01f;
-		constexpr float K2 = 0.03f;
+		auto& workspace = threadWorkspace();
 
-		constexpr float C1 = (K1*L) * (K1*L);
-		constexpr float C2 = (K2*L) * (K2*L);
+		RowSource reference{ referenceImage.data.data(), size, (unsigned int)scale, workspace.referenceColumnSums };
+		RowSource compare{ compareImage.data.data(), size, (unsigned int)scale, workspace.compareColumnSums };
 
-		double ssim_sum = 0.0;
-		float norm = 1.0f / (SQUARE_LEN * SQUARE_LEN);
+		const Size scaledSize = reference.GetSize();
 
-		for (unsigned int offset = 0; offset < totalSize; offset++)
+		if (scaledSize.m_width < SQUARE_LEN || scaledSize.m_height < SQUARE_LEN)
 		{
-			ref_mu[offset] *= norm;
-			cmp_mu[offset] *= norm;
+			throw std::invalid_argument("Images too small");
+		}
 
-			float ref_mu_sq =  ref_mu[offset] * ref_mu[offset];
-			float cmp_mu_sq = cmp_mu[offset] * cmp_mu[offset];
+		auto bandSum = [&](unsigned int firstWindow, unsigned int windowRows) {
+			return ssim(reference, compare, firstWindow, windowRows);
+		};
 
-			float ref_sigma_sqd_value = ref_sigma_sqd[offset] * norm - ref_mu_sq;
-			float cmp_sigma_sqd_value = cmp_sigma_sqd[offset] * norm - cmp_mu_sq;
+		return function(bandSum, Size{ scaledSize.m_width - SQUARE_LEN + 1, scaledSize.m_height - SQUARE_LEN + 1 });
+	}
 
-			float denominator = (ref_mu_sq + cmp_mu_sq + C1) * (ref_sigma_sqd_value + cmp_sigma_sqd_value + C2);
+	// One sided normal quantile, by bisection on erfc since it is only needed once per call
+	double normalQuantile(double probability)
+	{
+		double low = 0.0;
+		double high = 10.0;
 
-			float sigma_both_value = sigma_both[offset] * norm - ref_mu[offset] * cmp_mu[offset];
+		for (int i = 0; i < 60; i++)
+		{
+			const double middle = (low + high) / 2;
 
-			float numerator   = (2.0f * ref_mu[offset] * cmp_mu[offset] + C1) * (2.0f * sigma_both_value + C2);
-			ssim_sum += numerator / denominator;
+			if (0.5 * std::erfc(-middle / std::sqrt(2.0)) < probability)
+			{
+				low = middle;
+			}
+			else
+			{
+				high = middle;
+			}
 		}
 
-		delete[] ref_mu;
-		delete[] cmp_mu;
-		delete[] ref_sigma_sqd;
-		delete[] cmp_sigma_sqd;
-		delete[] sigma_both;
-
-		return (float)(ssim_sum / totalSize);
+		return (low + high) / 2;
 	}
 
-	int computeScale(Size size)
+	#define BAND_ROWS 64
+	#define MINIMUM_SAMPLED_BANDS 4
+
+	Similarity ComputeSsim(const Image& referenceImage, const Image& compareImage)
 	{
-		return std::max(1, (int)(std::min(size.m_width, size.m_height) / 256.0f + 0.5f)); // TODO
+		return{ withBandSum(referenceImage, compareImage, [](auto& bandSum, Size windows) {
+			return (float)(bandSum(0, windows.m_height) / windows.Total());
+		}) };
 	}
 
-	std::unique_ptr<float[]> convertToFloat(const uint8_t* image, Size size)
+	SsimEstimate ComputeSsim(const Image& referenceImage, const Image& compareImage, Similarity targetSimilarity, double confidence)
 	{
-		unsigned int totalSize = size.Total();
+		const double target = targetSimilarity.GetValue();
+		const double z = (confidence < 1.0) ? normalQuantile(confidence) : 0.0;
 
-		auto floatImage = std::make_unique<float[]>(totalSize);
-		auto floatImagePointer = floatImage.get();
+		return withBandSum(referenceImage, compareImage, [target, confidence, z](auto& bandSum, Size windows) {
+			const unsigned int bands = (windows.m_height + BAND_ROWS - 1) / BAND_ROWS;
+			const double total = windows.Total();
 
-		for (unsigned int i = 0; i < totalSize; i++) // *p++ agambini unroll
-		{
-			floatImagePointer[i] = static_cast<float>(image[i]);
-		}
+			double sum = 0.0;
+			double computed = 0.0;
 
-		return floatImage;
-	}
+			// Of the band means, for the confidence test
+			unsigned int sampled = 0;
+			double meanSum = 0.0;
+			double meanSquaredSum = 0.0;
 
-	// TODO usare int
-	Similarity ComputeSsim(const Image& referenceImage, const Image& compareImage)
-	{
-		if (referenceImage.width != compareImage.width || referenceImage.height != compareImage.height)
-		{
-			throw std::invalid_argument("Images must be same size");
-		}
+			auto& comparedBands = threadWorkspace().comparedBands;
+			comparedBands.assign(bands, 0);
 
-		Size size = ImageSize(referenceImage);
+			// Every window ssim is in [-1, 1], whatever is left can't bring the mean back across the target
+			auto decided = [&]() {
+				const double remaining = total - computed;
 
-		std::unique_ptr<float[]> referenceFloat;
-		std::unique_ptr<float[]> compareFloat;
+				return remaining > 0.0 && (sum + remaining < target * total || sum - remaining > target * total);
+			};
 
-		int scale = computeScale(size);
+			// The bands left, top to bottom, each run of consecutive ones in a single pass
+			auto compareRuns = [&]() {
+				for (unsigned int band = 0; band < bands; band++)
+				{
+					if (comparedBands[band])
+					{
+						continue;
+					}
 
-		if (scale > 1)
-		{
-			Size newSize;
-			std::tie(referenceFloat, newSize) = decimate(referenceImage.data.data(), size, scale);
-			std::tie(compareFloat, newSize) = decimate(compareImage.data.data(), size, scale);
-			
-			size = newSize;
-		}
-		else
-		{
-			referenceFloat = convertToFloat(referenceImage.data.data(), size);
-			compareFloat = convertToFloat(compareImage.data.data(), size);
-		}
-		
-		return{ ssim(referenceFloat.get(), compareFloat.get(), size) };
+					unsigned int last = band;
+
+					while (last + 1 < bands && !comparedBands[last + 1])
+					{
+						last++;
+					}
+
+					const unsigned int firstWindow = band * BAND_ROWS;
+					const unsigned int windowRows = std::min<unsigned int>((last + 1) * BAND_ROWS, windows.m_height) - firstWindow;
+
+					sum += bandSum(firstWindow, windowRows);
+					computed += static_cast<double>(windowRows) * windows.m_width;
+
+					if (decided())
+					{
+						return SsimEstimate{ (float)(sum / computed), false };
+					}
+
+					band = last;
+				}
+
+				return SsimEstimate{ (float)(sum / total), true };
+			};
+
+			// Bit reversed order of the bands, so any prefix is spread over the whole image
+			unsigned int stride = 1;
+
+			while (stride * 2 < bands)
+			{
+				stride *= 2;
+			}
+
+			for (unsigned int step = stride; step > 0; step /= 2)
+			{
+				// Multiples of the stride first, then the odd multiples of each smaller step
+				const unsigned int first = (step == stride) ? 0 : step;
+				const unsigned int increment = (step == stride) ? step : 2 * step;
+
+				for (unsigned int band = first; band < bands; band += increment)
+				{
+					// Without the confidence test a mean above the target is only confirmed once nearly every window is compared:
+					// the other bands are compared in runs, which don't each read the SQUARE_LEN - 1 rows shared with the band above
+					if (confidence >= 1.0 && computed > 0.0 && sum >= target * computed)
+					{
+						return compareRuns();
+					}
+
+					const unsigned int firstWindow = band * BAND_ROWS;
+					const unsigned int windowRows = std::min<unsigned int>(BAND_ROWS, windows.m_height - firstWindow);
+
+					const double bandSsim = bandSum(firstWindow, windowRows);
+					const double bandWindows = static_cast<double>(windowRows) * windows.m_width;
+
+					sum += bandSsim;
+					computed += bandWindows;
+					comparedBands[band] = 1;
+
+					if (decided())
+					{
+						return SsimEstimate{ (float)(sum / computed), false };
+					}
+
+					const double remaining = total - computed;
+
+					sampled++;
+					meanSum += bandSsim / bandWindows;
+					meanSquaredSum += (bandSsim / bandWindows) * (bandSsim / bandWindows);
+
+					if (confidence < 1.0 && remaining > 0.0 && sampled >= MINIMUM_SAMPLED_BANDS)
+					{
+						const double mean = meanSum / sampled;
+						const double variance = std::max(0.0, (meanSquaredSum - sampled * mean * mean) / (sampled - 1));
+
+						// Sampling without replacement, the error vanishes as the bands run out
+						const double standardError = std::sqrt(variance / sampled * (1.0 - static_cast<double>(sampled) / bands));
+
+						if (std::abs(mean - target) > z * standardError)
+						{
+							return SsimEstimate{ (float)(sum / computed), false };
+						}
+					}
+				}
+			}
+
+			return SsimEstimate{ (float)(sum / total), true };
+		});
 	}
 }
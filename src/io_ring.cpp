@@ -0,0 +1,408 @@
+#include "io_ring.hpp"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define IOPT_IO_URING
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef IOPT_IO_URING
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+struct IoRing::Transfer
+{
+	int descriptor;
+	uint8_t* data;
+	size_t size;
+	bool write;
+
+	size_t done = 0;
+	int error = 0;
+};
+
+#ifdef IOPT_IO_URING
+
+// There is no wrapper in the C library, the calls are made directly
+struct IoRing::Ring
+{
+	~Ring()
+	{
+		if (entries != nullptr)
+		{
+			munmap(entries, entriesSize);
+		}
+
+		if (completionMemory != nullptr && completionMemory != queueMemory)
+		{
+			munmap(completionMemory, completionSize);
+		}
+
+		if (queueMemory != nullptr)
+		{
+			munmap(queueMemory, queueSize);
+		}
+
+		if (descriptor >= 0)
+		{
+			close(descriptor);
+		}
+	}
+
+	int descriptor = -1;
+	unsigned int depth = 0;
+
+	void* queueMemory = nullptr;
+	size_t queueSize = 0;
+	void* completionMemory = nullptr;
+	size_t completionSize = 0;
+	io_uring_sqe* entries = nullptr;
+	size_t entriesSize = 0;
+
+	unsigned int* queueHead = nullptr;
+	unsigned int* queueTail = nullptr;
+	unsigned int queueMask = 0;
+	unsigned int* queueArray = nullptr;
+
+	unsigned int* completionHead = nullptr;
+	unsigned int* completionTail = nullptr;
+	unsigned int completionMask = 0;
+	io_uring_cqe* completions = nullptr;
+};
+
+namespace
+{
+	void* mapRing(int descriptor, size_t size, off_t offset)
+	{
+		void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, descriptor, offset);
+
+		return memory != MAP_FAILED ? memory : nullptr;
+	}
+
+	template <typename T>
+	T* at(void* memory, uint32_t offset)
+	{
+		return reinterpret_cast<T*>(static_cast<char*>(memory) + offset);
+	}
+}
+
+std::unique_ptr<IoRing> IoRing::Create(unsigned int depth)
+{
+	auto ring = std::make_unique<Ring>();
+
+	io_uring_params parameters;
+	std::memset(&parameters, 0, sizeof(parameters));
+
+	// Fails with ENOSYS on kernels before 5.1, and with EPERM where seccomp or a sysctl disables io_uring
+	ring->descriptor = static_cast<int>(syscall(__NR_io_uring_setup, depth, &parameters));
+
+	if (ring->descriptor < 0)
+	{
+		return nullptr;
+	}
+
+	ring->depth = parameters.sq_entries;
+	ring->queueSize = parameters.sq_off.array + parameters.sq_entries * sizeof(unsigned int);
+	ring->completionSize = parameters.cq_off.cqes + parameters.cq_entries * sizeof(io_uring_cqe);
+
+	const bool singleMapping = (parameters.features & IORING_FEAT_SINGLE_MMAP) != 0;
+
+	if (singleMapping)
+	{
+		ring->queueSize = ring->completionSize = std::max(ring->queueSize, ring->completionSize);
+	}
+
+	ring->queueMemory = mapRing(ring->descriptor, ring->queueSize, IORING_OFF_SQ_RING);
+	ring->completionMemory = singleMapping ? ring->queueMemory : mapRing(ring->descriptor, ring->completionSize, IORING_OFF_CQ_RING);
+
+	ring->entriesSize = parameters.sq_entries * sizeof(io_uring_sqe);
+	ring->entries = static_cast<io_uring_sqe*>(mapRing(ring->descriptor, ring->entriesSize, IORING_OFF_SQES));
+
+	if (ring->queueMemory == nullptr || ring->completionMemory == nullptr || ring->entries == nullptr)
+	{
+		return nullptr;
+	}
+
+	ring->queueHead = at<unsigned int>(ring->queueMemory, parameters.sq_off.head);
+	ring->queueTail = at<unsigned int>(ring->queueMemory, parameters.sq_off.tail);
+	ring->queueMask = *at<unsigned int>(ring->queueMemory, parameters.sq_off.ring_mask);
+	ring->queueArray = at<unsigned int>(ring->queueMemory, parameters.sq_off.array);
+
+	ring->completionHead = at<unsigned int>(ring->completionMemory, parameters.cq_off.head);
+	ring->completionTail = at<unsigned int>(ring->completionMemory, parameters.cq_off.tail);
+	ring->completionMask = *at<unsigned int>(ring->completionMemory, parameters.cq_off.ring_mask);
+	ring->completions = at<io_uring_cqe>(ring->completionMemory, parameters.cq_off.cqes);
+
+	return std::unique_ptr<IoRing>(new IoRing(std::move(ring)));
+}
+
+void IoRing::ReadFiles(std::vector<FileRead>& files)
+{
+	std::vector<Transfer> transfers;
+	transfers.reserve(files.size());
+
+	for (auto& file : files)
+	{
+		file.data.clear();
+		file.error = 0;
+
+		const int descriptor = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat status;
+
+		if (descriptor < 0 || fstat(descriptor, &status) != 0)
+		{
+			file.error = errno;
+		}
+		else if (!S_ISREG(status.st_mode))
+		{
+			file.error = ESPIPE;
+		}
+		else
+		{
+			file.data.resize(static_cast<size_t>(status.st_size));
+		}
+
+		transfers.push_back({ descriptor, file.data.data(), file.data.size(), false });
+	}
+
+	try
+	{
+		run(transfers);
+	}
+	catch (...)
+	{
+		for (const auto& transfer : transfers)
+		{
+			if (transfer.descriptor >= 0)
+			{
+				close(transfer.descriptor);
+			}
+		}
+
+		throw;
+	}
+
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		auto& file = files[i];
+
+		if (file.error == 0)
+		{
+			file.error = transfers[i].error;
+
+			// Shorter when the file was truncated since its size was read
+			file.data.resize(transfers[i].done);
+		}
+
+		if (transfers[i].descriptor >= 0)
+		{
+			close(transfers[i].descriptor);
+		}
+	}
+}
+
+void IoRing::WriteFiles(std::vector<FileWrite>& files)
+{
+	std::vector<Transfer> transfers;
+	transfers.reserve(files.size());
+
+	for (auto& file : files)
+	{
+		file.error = 0;
+
+		transfers.push_back({ file.descriptor, const_cast<uint8_t*>(file.data), file.size, true });
+	}
+
+	run(transfers);
+
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		files[i].error = transfers[i].error;
+	}
+}
+
+void IoRing::run(std::vector<Transfer>& transfers)
+{
+	auto& ring = *m_ring;
+
+	// The kernel may read the vectors until the transfer completes, each transfer keeps its own
+	std::vector<iovec> vectors(transfers.size());
+
+	// Last to submit first, so the transfers start in order
+	std::vector<size_t> waiting;
+
+	for (size_t i = transfers.size(); i-- > 0;)
+	{
+		if (transfers[i].size > 0)
+		{
+			waiting.push_back(i);
+		}
+	}
+
+	unsigned int inFlight = 0;
+
+	while (!waiting.empty() || inFlight > 0)
+	{
+		// This thread is the only one adding entries
+		unsigned int tail = *ring.queueTail;
+
+		while (!waiting.empty() && inFlight < ring.depth)
+		{
+			const size_t index = waiting.back();
+			waiting.pop_back();
+
+			auto& transfer = transfers[index];
+			vectors[index] = { transfer.data + transfer.done, transfer.size - transfer.done };
+
+			const unsigned int slot = tail & ring.queueMask;
+			io_uring_sqe& entry = ring.entries[slot];
+
+			std::memset(&entry, 0, sizeof(entry));
+			entry.opcode = transfer.write ? IORING_OP_WRITEV : IORING_OP_READV;
+			entry.fd = transfer.descriptor;
+			entry.off = transfer.done;
+			entry.addr = reinterpret_cast<uint64_t>(&vectors[index]);
+			entry.len = 1;
+			entry.user_data = index;
+
+			ring.queueArray[slot] = slot;
+
+			tail++;
+			inFlight++;
+		}
+
+		__atomic_store_n(ring.queueTail, tail, __ATOMIC_RELEASE);
+
+		const unsigned int unsubmitted = tail - __atomic_load_n(ring.queueHead, __ATOMIC_ACQUIRE);
+
+		if (syscall(__NR_io_uring_enter, ring.descriptor, unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+			errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+			const int error = errno;
+
+			// The kernel may still read the vectors and fill the buffers, which unwinding frees
+			drain(inFlight);
+
+			throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(error));
+		}
+
+		unsigned int head = *ring.completionHead;
+		const unsigned int completed = __atomic_load_n(ring.completionTail, __ATOMIC_ACQUIRE);
+
+		for (; head != completed; head++)
+		{
+			const io_uring_cqe& completion = ring.completions[head & ring.completionMask];
+			const auto index = static_cast<size_t>(completion.user_data);
+			auto& transfer = transfers[index];
+
+			inFlight--;
+
+			if (completion.res == -EINTR || completion.res == -EAGAIN)
+			{
+				waiting.push_back(index);
+			}
+			else if (completion.res < 0)
+			{
+				transfer.error = -completion.res;
+			}
+			else if (completion.res == 0)
+			{
+				// End of file for reads, writes that make no progress won't make any
+				if (transfer.write)
+				{
+					transfer.error = EIO;
+				}
+			}
+			else
+			{
+				transfer.done += static_cast<size_t>(completion.res);
+
+				if (transfer.done < transfer.size)
+				{
+					waiting.push_back(index);
+				}
+			}
+		}
+
+		__atomic_store_n(ring.completionHead, head, __ATOMIC_RELEASE);
+	}
+}
+
+void IoRing::drain(unsigned int inFlight)
+{
+	auto& ring = *m_ring;
+
+	// Without a polling thread the kernel only consumes entries in io_uring_enter, the ones left were never seen
+	const unsigned int consumed = __atomic_load_n(ring.queueHead, __ATOMIC_ACQUIRE);
+
+	inFlight -= *ring.queueTail - consumed;
+	__atomic_store_n(ring.queueTail, consumed, __ATOMIC_RELEASE);
+
+	while (inFlight > 0)
+	{
+		// Completions are also posted on the way back from any other call, yielding keeps waiting if entering fails again
+		if (syscall(__NR_io_uring_enter, ring.descriptor, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+		{
+			sched_yield();
+		}
+
+		const unsigned int head = *ring.completionHead;
+		const unsigned int completed = __atomic_load_n(ring.completionTail, __ATOMIC_ACQUIRE);
+
+		inFlight -= completed - head;
+		__atomic_store_n(ring.completionHead, completed, __ATOMIC_RELEASE);
+	}
+}
+
+#else
+
+struct IoRing::Ring
+{
+};
+
+std::unique_ptr<IoRing> IoRing::Create(unsigned int)
+{
+	return nullptr;
+}
+
+void IoRing::ReadFiles(std::vector<FileRead>& files)
+{
+	for (auto& file : files)
+	{
+		file.error = ENOSYS;
+	}
+}
+
+void IoRing::WriteFiles(std::vector<FileWrite>& files)
+{
+	for (auto& file : files)
+	{
+		file.error = ENOSYS;
+	}
+}
+
+void IoRing::run(std::vector<Transfer>&)
+{
+}
+
+void IoRing::drain(unsigned int)
+{
+}
+
+#endif
+
+IoRing::IoRing(std::unique_ptr<Ring> ring) : m_ring{ std::move(ring) }
+{
+}
+
+IoRing::~IoRing() = default;
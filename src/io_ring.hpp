@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "uninitialized_vector.hpp"
+
+
+// Reads whole files, and writes whole buffers to open files, through io_uring so a single thread keeps a batch
+// of transfers in flight instead of blocking on each one. Files are opened and closed with plain calls, only the
+// data goes through the ring. Linux only: Create returns nullptr when the build or the kernel doesn't support it
+class IoRing
+{
+public:
+	struct FileRead
+	{
+		std::string path;
+
+		// Read in place, without clearing it first
+		UninitializedBytes data;
+
+		// errno of the failed transfers, 0 when the whole file was read
+		int error = 0;
+	};
+
+	// To a file opened by the caller, which closes it
+	struct FileWrite
+	{
+		int descriptor;
+		const uint8_t* data;
+		size_t size;
+
+		// errno of the failed transfers, the file may then be left partially written
+		int error = 0;
+	};
+
+	// depth is the number of transfers in flight at most
+	static std::unique_ptr<IoRing> Create(unsigned int depth);
+	~IoRing();
+
+	IoRing(const IoRing&) = delete;
+	IoRing& operator=(const IoRing&) = delete;
+
+	// Only regular files are read, others fail with ESPIPE and are left to blocking reads
+	void ReadFiles(std::vector<FileRead>& files);
+
+	void WriteFiles(std::vector<FileWrite>& files);
+
+private:
+	// Mapped queues of the kernel, defined where io_uring is available
+	struct Ring;
+	struct Transfer;
+
+	explicit IoRing(std::unique_ptr<Ring> ring);
+
+	// Returns once every transfer is complete or failed, short transfers are continued
+	void run(std::vector<Transfer>& transfers);
+
+	// Takes back the entries the kernel hasn't consumed and waits for the others to complete,
+	// so no transfer still uses buffers that are about to be freed
+	void drain(unsigned int inFlight);
+
+	std::unique_ptr<Ring> m_ring;
+};
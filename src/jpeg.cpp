@@ -3,7 +3,19 @@
 #include "turbojpeg.h"
 
 #include <fstream>
+#include <algorithm>
 #include <chrono>
+#include <new>
+#include <cstring>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 
 TJSAMP chromaSampling(TJPF colorspace) {
@@ -12,86 +24,533 @@ TJSAMP chromaSampling(TJPF colorspace) {
 
 namespace jpeg {
 
-	std::vector<uint8_t> memory_encode(const Image& image, TJPF colorspace, unsigned int quality) {
-		auto imageData{ image.data.data() };
+	Buffer::~Buffer() {
+		tjFree(m_data);
+	}
 
-		tjhandle _jpegCompressor = tjInitCompress();
+	Buffer::Buffer(Buffer&& other) noexcept :
+		m_data{ other.m_data }, m_size{ other.m_size }, m_capacity{ other.m_capacity }
+	{
+		other.m_data = nullptr;
+		other.m_size = 0;
+		other.m_capacity = 0;
+	}
 
-		unsigned char* compressedImage = nullptr;
-		unsigned long size;
+	Buffer& Buffer::operator=(Buffer&& other) noexcept {
+		if (this != &other) {
+			tjFree(m_data);
 
-		auto res = tjCompress2(_jpegCompressor, imageData, image.width, 0, image.height, colorspace,
-			&compressedImage, &size, chromaSampling(colorspace), quality, TJFLAG_ACCURATEDCT);
+			m_data = other.m_data;
+			m_size = other.m_size;
+			m_capacity = other.m_capacity;
 
-		tjDestroy(_jpegCompressor);
+			other.m_data = nullptr;
+			other.m_size = 0;
+			other.m_capacity = 0;
+		}
 
-		if (res != 0) {
-			tjFree(compressedImage);
+		return *this;
+	}
+
+	void Buffer::Reserve(size_t capacity) {
+		if (capacity <= m_capacity) {
+			return;
+		}
+
+		tjFree(m_data);
+
+		m_data = tjAlloc(static_cast<int>(capacity));
+		m_size = 0;
+		m_capacity = m_data ? capacity : 0;
+
+		if (m_data == nullptr) {
+			throw std::bad_alloc();
+		}
+	}
+
+	void Buffer::Resize(size_t size) {
+		Reserve(size);
+
+		m_size = size;
+	}
+
+	FileData::~FileData() {
+		unmap();
+	}
+
+	FileData::FileData(FileData&& other) noexcept :
+		m_mapping{ other.m_mapping }, m_size{ other.m_size }, m_buffer{ std::move(other.m_buffer) }
+	{
+		other.m_mapping = nullptr;
+		other.m_size = 0;
+	}
+
+	FileData& FileData::operator=(FileData&& other) noexcept {
+		if (this != &other) {
+			unmap();
+
+			m_mapping = other.m_mapping;
+			m_size = other.m_size;
+			m_buffer = std::move(other.m_buffer);
+
+			other.m_mapping = nullptr;
+			other.m_size = 0;
+		}
+
+		return *this;
+	}
+
+	void FileData::unmap() {
+#ifndef _WIN32
+		if (m_mapping != nullptr) {
+			munmap(m_mapping, m_size);
+			m_mapping = nullptr;
+		}
+#endif
+	}
+
+	Codec::Codec() :
+		m_compressor{ tjInitCompress() },
+		m_decompressor{ tjInitDecompress() }
+	{
+		if (m_compressor == nullptr || m_decompressor == nullptr) {
+			tjDestroy(m_compressor);
+			tjDestroy(m_decompressor);
 
 			throw std::runtime_error(tjGetErrorStr());
 		}
+	}
 
-		std::vector<uint8_t> compressed(compressedImage, compressedImage + size);
+	Codec::~Codec() {
+		tjDestroy(m_compressor);
+		tjDestroy(m_decompressor);
+	}
+
+	Codec& thread_codec() {
+		thread_local Codec codec;
 
-		tjFree(compressedImage);
-		
-		return compressed;
+		return codec;
 	}
 
-	Image memory_decode(const std::vector<uint8_t>& buffer, TJPF colorspace) {
-		int jpegSubsamp;
+	void memory_encode(const Image& image, TJPF colorspace, int subsampling, unsigned int quality, Buffer& output, Codec& codec) {
+		auto imageData{ image.data.data() };
 
-		tjhandle _jpegDecompressor = tjInitDecompress();
-		Image image;
+		// Worst case size, so turbojpeg never needs to reallocate
+		output.Reserve(tjBufSize(image.width, image.height, subsampling));
+
+		unsigned char* compressedImage = output.Data();
+		unsigned long size = static_cast<unsigned long>(output.Capacity());
+
+		auto res = tjCompress2(codec.Compressor(), imageData, image.width, 0, image.height, colorspace,
+			&compressedImage, &size, subsampling, quality, TJFLAG_ACCURATEDCT | TJFLAG_NOREALLOC);
+
+		if (res != 0) {
+			throw std::runtime_error(tjGetErrorStr2(codec.Compressor()));
+		}
 
-		tjDecompressHeader2(_jpegDecompressor, const_cast<uint8_t*>(buffer.data()), buffer.size(), &image.width, &image.height, &jpegSubsamp);
+		output.Resize(size);
+	}
+
+	void memory_encode(const Image& image, TJPF colorspace, unsigned int quality, Buffer& output, Codec& codec) {
+		memory_encode(image, colorspace, chromaSampling(colorspace), quality, output, codec);
+	}
+
+	void memory_decode(const uint8_t* data, size_t size, TJPF colorspace, Image& image, Codec& codec) {
+		int jpegSubsamp;
+
+		if (tjDecompressHeader2(codec.Decompressor(), const_cast<uint8_t*>(data), size, &image.width, &image.height, &jpegSubsamp) != 0) {
+			throw std::runtime_error(tjGetErrorStr2(codec.Decompressor()));
+		}
 
 		auto channels{ tjPixelSize[colorspace] };
 
-		image.data = std::vector<unsigned char>(image.width * image.height * channels);
+		// resize keeps the capacity, an image of the same size is decoded in place
+		image.data.resize(static_cast<size_t>(image.width) * image.height * channels);
 
-		tjDecompress2(_jpegDecompressor, buffer.data(), buffer.size(), image.data.data(), image.width, 0/*pitch*/, image.height, colorspace, TJFLAG_ACCURATEDCT);
+		if (tjDecompress2(codec.Decompressor(), data, size, image.data.data(), image.width, 0/*pitch*/, image.height, colorspace, TJFLAG_ACCURATEDCT) != 0) {
+			throw std::runtime_error(tjGetErrorStr2(codec.Decompressor()));
+		}
+	}
 
-		tjDestroy(_jpegDecompressor);
+	void memory_encode_grayscale(const Image& image, unsigned int quality, Buffer& output, Codec& codec) {
+		memory_encode(image, TJPF_GRAY, quality, output, codec);
+	}
 
-		return image;
+	void memory_decode_grayscale(const uint8_t* data, size_t size, Image& output, Codec& codec) {
+		memory_decode(data, size, TJPF_GRAY, output, codec);
 	}
 
-	std::vector<uint8_t> memory_encode_grayscale(const Image& image, unsigned int quality) {
-		return memory_encode(image, TJPF_GRAY, quality);
+	int PlanarImage::Components() const {
+		return subsampling == TJSAMP_GRAY ? 1 : 3;
 	}
 
-	Image memory_decode_grayscale(const std::vector<uint8_t>& buffer) {
-		return memory_decode(buffer, TJPF_GRAY);
+	static TJPF pixel_format(PixelFormat format) {
+		return format == PixelFormat::Cmyk ? TJPF_CMYK : TJPF_RGB;
 	}
 
-	void save(const Image& image, const std::string& filename, unsigned int quality) {
-		auto compressedImage = memory_encode(image, TJPF_RGB, quality);
+	void memory_decode_planar(const uint8_t* data, size_t size, PlanarImage& output, Codec& codec) {
+		int colorspace;
+
+		if (tjDecompressHeader3(codec.Decompressor(), data, size, &output.width, &output.height, &output.subsampling, &colorspace) != 0) {
+			throw std::runtime_error(tjGetErrorStr2(codec.Decompressor()));
+		}
+
+		if (colorspace == TJCS_RGB || colorspace == TJCS_CMYK || colorspace == TJCS_YCCK) {
+			output.pixelFormat = (colorspace == TJCS_RGB) ? PixelFormat::Rgb : PixelFormat::Cmyk;
+
+			for (auto& plane : output.planes) {
+				plane.clear();
+			}
+
+			// Encoded back with the same subsampling, any works from pixels
+			if (output.subsampling < 0 || output.subsampling >= TJ_NUMSAMP || output.subsampling == TJSAMP_GRAY) {
+				output.subsampling = TJSAMP_444;
+			}
+
+			memory_decode(data, size, pixel_format(output.pixelFormat), output.pixels, codec);
+
+			return;
+		}
+
+		if (colorspace != TJCS_YCbCr && colorspace != TJCS_GRAY) {
+			throw std::runtime_error("Unsupported colorspace");
+		}
+
+		if (output.subsampling < 0 || output.subsampling >= TJ_NUMSAMP) {
+			throw std::runtime_error("Unsupported chroma subsampling");
+		}
+
+		output.pixelFormat = PixelFormat::None;
+		output.pixels.data.clear();
 
-		std::ofstream imOut(filename, std::ios::binary);
+		unsigned char* planes[3] = { nullptr, nullptr, nullptr };
+
+		for (int component = 0; component < 3; component++) {
+			if (component < output.Components()) {
+				output.strides[component] = tjPlaneWidth(component, output.width, output.subsampling);
+				output.planes[component].resize(static_cast<size_t>(output.strides[component]) * tjPlaneHeight(component, output.height, output.subsampling));
+
+				planes[component] = output.planes[component].data();
+			}
+			else {
+				output.strides[component] = 0;
+				output.planes[component].clear();
+			}
+		}
 
-		imOut.write(reinterpret_cast<char*>(compressedImage.data()), compressedImage.size());
+		if (tjDecompressToYUVPlanes(codec.Decompressor(), data, size, planes, output.width, output.strides, output.height, TJFLAG_ACCURATEDCT) != 0) {
+			throw std::runtime_error(tjGetErrorStr2(codec.Decompressor()));
+		}
 	}
 
-	Image load(const std::string& imagePath, TJPF colorspace) {
-		std::ifstream file(imagePath, std::ios::binary | std::ios::ate);
-		std::streamsize size = file.tellg();
-		file.seekg(0, std::ios::beg);
+	void memory_encode_planar(const PlanarImage& image, unsigned int quality, Buffer& output, Codec& codec) {
+		if (image.pixelFormat != PixelFormat::None) {
+			memory_encode(image.pixels, pixel_format(image.pixelFormat), image.subsampling, quality, output, codec);
 
-		std::vector<unsigned char> buffer(size);
-		if (file.read(reinterpret_cast<char*>(buffer.data()), size))
-		{
-			/* worked! */
+			return;
 		}
 
-		return memory_decode(buffer, colorspace);
+		const unsigned char* planes[3] = { image.planes[0].data(), image.planes[1].data(), image.planes[2].data() };
+
+		output.Reserve(tjBufSize(image.width, image.height, image.subsampling));
+
+		unsigned char* compressedImage = output.Data();
+		unsigned long size = static_cast<unsigned long>(output.Capacity());
+
+		auto res = tjCompressFromYUVPlanes(codec.Compressor(), planes, image.width, image.strides, image.height, image.subsampling,
+			&compressedImage, &size, quality, TJFLAG_ACCURATEDCT | TJFLAG_NOREALLOC);
+
+		if (res != 0) {
+			throw std::runtime_error(tjGetErrorStr2(codec.Compressor()));
+		}
+
+		output.Resize(size);
 	}
 
-	Image load_color(const std::string& imagePath) {
-		return load(imagePath, TJPF_RGB);
+	// Same weights as the YCbCr conversion of libjpeg, in 16 bits fixed point
+	static uint8_t luma(unsigned int red, unsigned int green, unsigned int blue) {
+		return static_cast<uint8_t>((19595 * red + 38470 * green + 7471 * blue + 32768) >> 16);
 	}
 
-	Image load_grayscale(const std::string& imagePath) {
-		return load(imagePath, TJPF_GRAY);
+	void luma_plane(const PlanarImage& image, Image& output) {
+		output.width = image.width;
+		output.height = image.height;
+		output.data.resize(static_cast<size_t>(image.width) * image.height);
+
+		const auto* pixel = image.pixels.data.data();
+
+		if (image.pixelFormat == PixelFormat::Rgb) {
+			for (auto& value : output.data) {
+				value = luma(pixel[0], pixel[1], pixel[2]);
+				pixel += 3;
+			}
+
+			return;
+		}
+
+		// Inverted like Adobe applications store it, 255 is no ink
+		if (image.pixelFormat == PixelFormat::Cmyk) {
+			for (auto& value : output.data) {
+				value = luma(pixel[0] * pixel[3] / 255, pixel[1] * pixel[3] / 255, pixel[2] * pixel[3] / 255);
+				pixel += 4;
+			}
+
+			return;
+		}
+
+		for (int row = 0; row < image.height; row++) {
+			std::memcpy(&output.data[static_cast<size_t>(row) * image.width], &image.planes[0][static_cast<size_t>(row) * image.strides[0]], image.width);
+		}
+	}
+
+	void save_file(const std::string& filename, const uint8_t* data, size_t size) {
+		std::ofstream file(filename, std::ios::binary);
+
+		if (!file.write(reinterpret_cast<const char*>(data), size) || !file.flush()) {
+			throw std::runtime_error("Unable to write " + filename);
+		}
+	}
+
+#ifdef _WIN32
+	FileData load_file(const std::string& imagePath) {
+		std::ifstream stream(imagePath, std::ios::binary);
+
+		if (!stream) {
+			throw std::runtime_error("Unable to open " + imagePath);
+		}
+
+		FileData file;
+		file.m_buffer.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+
+		if (stream.bad()) {
+			throw std::runtime_error("Unable to read " + imagePath);
+		}
+
+		file.m_size = file.m_buffer.size();
+
+		return file;
+	}
+#else
+	[[noreturn]] static void throw_file_error(const char* action, const std::string& path) {
+		throw std::runtime_error(std::string(action) + " " + path + ": " + std::strerror(errno));
+	}
+
+	FileData load_file(const std::string& imagePath) {
+		const int descriptor = open(imagePath.c_str(), O_RDONLY | O_CLOEXEC);
+
+		if (descriptor < 0) {
+			throw_file_error("Unable to open", imagePath);
+		}
+
+		struct Closer {
+			int descriptor;
+
+			~Closer() { close(descriptor); }
+		} closer{ descriptor };
+
+		struct stat status;
+
+		if (fstat(descriptor, &status) != 0) {
+			throw_file_error("Unable to read", imagePath);
+		}
+
+		FileData file;
+
+		if (S_ISREG(status.st_mode) && status.st_size > 0) {
+			const auto size = static_cast<size_t>(status.st_size);
+
+			// Populating reads the whole file now, on the thread loading it rather than on the one decoding it
+			int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+			flags |= MAP_POPULATE;
+#endif
+			void* mapping = mmap(nullptr, size, PROT_READ, flags, descriptor, 0);
+
+			if (mapping != MAP_FAILED) {
+				madvise(mapping, size, MADV_SEQUENTIAL);
+
+				file.m_mapping = static_cast<uint8_t*>(mapping);
+				file.m_size = size;
+
+				return file;
+			}
+		}
+
+		// Pipes, devices and file systems that can't be mapped are read until their end, their size is unknown
+		const size_t chunk = S_ISREG(status.st_mode) ? static_cast<size_t>(status.st_size) + 1 : 65536;
+
+		while (true) {
+			if (file.m_buffer.size() == file.m_size) {
+				file.m_buffer.resize(file.m_size + chunk);
+			}
+
+			const auto count = read(descriptor, file.m_buffer.data() + file.m_size, file.m_buffer.size() - file.m_size);
+
+			if (count < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+
+				throw_file_error("Unable to read", imagePath);
+			}
+
+			if (count == 0) {
+				break;
+			}
+
+			file.m_size += static_cast<size_t>(count);
+		}
+
+		file.m_buffer.resize(file.m_size);
+
+		return file;
 	}
-}
\ No newline at end of file
+#endif
+
+	Image load(const std::string& imagePath, TJPF colorspace, Codec& codec) {
+		auto file = load_file(imagePath);
+
+		Image image;
+
+		memory_decode(file.Data(), file.Size(), colorspace, image, codec);
+
+		return image;
+	}
+
+	Image load_grayscale(const std::string& imagePath, Codec& codec) {
+		return load(imagePath, TJPF_GRAY, codec);
+	}
+
+	namespace {
+		// Annex K tables, in natural order
+		const unsigned int s_standardTables[2][64] = {
+			{
+				16, 11, 10, 16, 24, 40, 51, 61,
+				12, 12, 14, 19, 26, 58, 60, 55,
+				14, 13, 16, 24, 40, 57, 69, 56,
+				14, 17, 22, 29, 51, 87, 80, 62,
+				18, 22, 37, 56, 68, 109, 103, 77,
+				24, 35, 55, 64, 81, 104, 113, 92,
+				49, 64, 78, 87, 103, 121, 120, 101,
+				72, 92, 95, 98, 112, 100, 103, 99
+			},
+			{
+				17, 18, 24, 47, 99, 99, 99, 99,
+				18, 21, 26, 66, 99, 99, 99, 99,
+				24, 26, 56, 99, 99, 99, 99, 99,
+				47, 66, 99, 99, 99, 99, 99, 99,
+				99, 99, 99, 99, 99, 99, 99, 99,
+				99, 99, 99, 99, 99, 99, 99, 99,
+				99, 99, 99, 99, 99, 99, 99, 99,
+				99, 99, 99, 99, 99, 99, 99, 99
+			}
+		};
+
+		// Natural position of the coefficients stored in zigzag order
+		const unsigned int s_zigzag[64] = {
+			0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+			12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+			35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+			58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+		};
+
+		// Same scaling as jpeg_set_quality with force_baseline, which is what turbojpeg uses
+		unsigned int scaledQuantizer(unsigned int standard, unsigned int quality) {
+			const unsigned int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+			const unsigned int value = (standard * scale + 50) / 100;
+
+			return std::min(255u, std::max(1u, value));
+		}
+
+		// True when the standard table at this quality quantizes no coefficient more coarsely than table
+		bool finerOrEqual(const unsigned int* table, unsigned int tableIndex, unsigned int quality) {
+			for (unsigned int i = 0; i < 64; i++) {
+				if (scaledQuantizer(s_standardTables[tableIndex][i], quality) > table[i]) {
+					return false;
+				}
+			}
+
+			return true;
+		}
+	}
+
+	unsigned int estimate_quality(const uint8_t* data, size_t size) {
+		// Tables 0 and 1 hold luma and chroma in every common encoder, other slots are ignored
+		unsigned int tables[2][64];
+		bool found[2] = { false, false };
+
+		size_t position = 2;
+
+		if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+			return 0;
+		}
+
+		while (position + 4 <= size && data[position] == 0xFF) {
+			const unsigned int marker = data[position + 1];
+
+			if (marker == 0xFF) {
+				position++;
+				continue;
+			}
+
+			if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+				position += 2;
+				continue;
+			}
+
+			if (marker == 0xD9 || marker == 0xDA) {
+				break;
+			}
+
+			const size_t length = (static_cast<size_t>(data[position + 2]) << 8) | data[position + 3];
+			const size_t end = position + 2 + length;
+
+			if (length < 2 || end > size) {
+				break;
+			}
+
+			// DQT, possibly with several tables in one segment
+			if (marker == 0xDB) {
+				size_t offset = position + 4;
+
+				while (offset < end) {
+					const unsigned int precision = data[offset] >> 4;
+					const unsigned int index = data[offset] & 0x0F;
+					const size_t valueSize = precision ? 2 : 1;
+
+					offset++;
+
+					if (offset + 64 * valueSize > end) {
+						break;
+					}
+
+					if (index < 2) {
+						for (unsigned int i = 0; i < 64; i++) {
+							const uint8_t* value = data + offset + i * valueSize;
+							tables[index][s_zigzag[i]] = precision ? ((value[0] << 8) | value[1]) : value[0];
+						}
+
+						found[index] = true;
+					}
+
+					offset += 64 * valueSize;
+				}
+			}
+
+			position = end;
+		}
+
+		if (!found[0]) {
+			return 0;
+		}
+
+		// Higher qualities have finer or equal tables, so the first match is the lowest
+		for (unsigned int quality = 1; quality < 100; quality++) {
+			if (finerOrEqual(tables[0], 0, quality) && (!found[1] || finerOrEqual(tables[1], 1, quality))) {
+				return quality;
+			}
+		}
+
+		return 100;
+	}
+}
@@ -1,16 +1,132 @@
 #pragma once
 
 #include "iopt/image.hpp"
+#include "uninitialized_vector.hpp"
 
 #include <vector>
 #include <string>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
 
 namespace jpeg {
-	Image load_color(const std::string& imagePath);
-	Image load_grayscale(const std::string& imagePath);
+	// Memory from tjAlloc, so turbojpeg can write compressed data into it without copies
+	class Buffer
+	{
+	public:
+		Buffer() = default;
+		~Buffer();
+
+		Buffer(Buffer&& other) noexcept;
+		Buffer& operator=(Buffer&& other) noexcept;
+
+		Buffer(const Buffer&) = delete;
+		Buffer& operator=(const Buffer&) = delete;
+
+		uint8_t* Data() { return m_data; }
+		const uint8_t* Data() const { return m_data; }
+		size_t Size() const { return m_size; }
+		size_t Capacity() const { return m_capacity; }
+
+		// Growing discards the content, the memory is kept when shrinking
+		void Reserve(size_t capacity);
+		void Resize(size_t size);
+
+	private:
+		uint8_t* m_data = nullptr;
+		size_t m_size = 0;
+		size_t m_capacity = 0;
+	};
+
+	// Content of a whole file: mapped from regular files, read into memory from pipes and special files.
+	// Mapped files must not be truncated while in use, reading past the new end raises SIGBUS
+	class FileData
+	{
+	public:
+		FileData() = default;
+		explicit FileData(UninitializedBytes content) : m_size{ content.size() }, m_buffer{ std::move(content) } {}
+		~FileData();
+
+		FileData(FileData&& other) noexcept;
+		FileData& operator=(FileData&& other) noexcept;
+
+		FileData(const FileData&) = delete;
+		FileData& operator=(const FileData&) = delete;
+
+		const uint8_t* Data() const { return m_mapping ? m_mapping : m_buffer.data(); }
+		size_t Size() const { return m_size; }
+
+	private:
+		friend FileData load_file(const std::string& imagePath);
+
+		void unmap();
+
+		uint8_t* m_mapping = nullptr;
+		size_t m_size = 0;
+		UninitializedBytes m_buffer;
+	};
+
+	// Owns the turbojpeg handles, so consecutive calls on the same thread don't set up anything
+	class Codec
+	{
+	public:
+		Codec();
+		~Codec();
+
+		Codec(const Codec&) = delete;
+		Codec& operator=(const Codec&) = delete;
+
+		void* Compressor() const { return m_compressor; }
+		void* Decompressor() const { return m_decompressor; }
+
+	private:
+		void* m_compressor;
+		void* m_decompressor;
+	};
+
+	// Codec of the calling thread, created on first use
+	Codec& thread_codec();
+
+	// How the pixels of colorspaces that can't be kept as planes are stored
+	enum class PixelFormat { None, Rgb, Cmyk };
+
+	// Components as stored in the file, each plane padded to the subsampling factors like turbojpeg expects.
+	// Only YCbCr and grayscale files are kept as planes: RGB, CMYK and YCCK ones would change colors when
+	// encoded back as YCbCr, they are decoded to interleaved pixels instead and encoded from them
+	struct PlanarImage {
+		int width;
+		int height;
+		int subsampling;
+
+		std::vector<uint8_t> planes[3];
+		int strides[3];
+
+		PixelFormat pixelFormat = PixelFormat::None;
+		Image pixels;
+
+		int Components() const;
+	};
+
+	Image load_grayscale(const std::string& imagePath, Codec& codec);
+
+	// Throws if the file can't be opened or read completely
+	FileData load_file(const std::string& imagePath);
+
+	// Lowest standard (IJG) quality whose quantization tables are nowhere coarser than the ones in the file:
+	// encoding at a higher quality can't keep more detail than the file already has.
+	// 0 when the file has no quantization tables before the first scan
+	unsigned int estimate_quality(const uint8_t* data, size_t size);
 	
-	void save(const Image & image, const std::string& filename, unsigned int quality);
+	// Writes data already encoded, throws if the file can't be written completely
+	void save_file(const std::string& filename, const uint8_t* data, size_t size);
+
+	// Both reuse the memory of the output, they only allocate when it is too small
+	void memory_encode_grayscale(const Image & image, unsigned int quality, Buffer& output, Codec& codec);
+	void memory_decode_grayscale(const uint8_t* data, size_t size, Image& output, Codec& codec);
+
+	void memory_decode_planar(const uint8_t* data, size_t size, PlanarImage& output, Codec& codec);
+	void memory_encode_planar(const PlanarImage& image, unsigned int quality, Buffer& output, Codec& codec);
 
-	std::vector<uint8_t> memory_encode_grayscale(const Image & image, unsigned int quality);
-	Image memory_decode_grayscale(const std::vector<uint8_t>& buffer);
+	// Copies the Y plane without padding, or computes the luma of the pixels
+	void luma_plane(const PlanarImage& image, Image& output);
 };
@@ -1,18 +1,50 @@
 #include "optimization_sequence.hpp"
 
 #include <algorithm>
+#include <cmath>
 
 
 
-void OptimizationSequence::AddOptimizationResult(Quality quality, ImageSimilarity::Similarity ssim)
+void OptimizationSequence::AddOptimizationResult(Quality quality, ImageSimilarity::Similarity ssim, bool exact)
 {
 	m_optimizationResults.push_back(std::make_pair(quality, ssim));
+
+	if (!exact)
+	{
+		m_estimates.push_back(quality);
+	}
+}
+
+void OptimizationSequence::ReplaceEstimate(Quality quality, ImageSimilarity::Similarity ssim)
+{
+	auto result = std::find_if(m_optimizationResults.begin(), m_optimizationResults.end(), [quality](auto const& item) {return item.first == quality; });
+
+	if (result != m_optimizationResults.end())
+	{
+		result->second = ssim;
+	}
+
+	m_estimates.erase(std::remove(m_estimates.begin(), m_estimates.end(), quality), m_estimates.end());
 }
 
 Quality OptimizationSequence::BestQuality() const
 {
+	const bool anyExact = m_estimates.size() < m_optimizationResults.size();
+
+	// Estimates rank after every exact result
+	auto rank = [this, anyExact](const auto& result) {
+		return std::make_pair(anyExact && !IsExact(result.first), std::abs(result.second - m_targetSimilarity));
+	};
+
 	return (*std::min_element(m_optimizationResults.begin(), m_optimizationResults.end(), 
-		[targetSimilarity = m_targetSimilarity](const auto& first, const auto& second) {return abs(first.second - targetSimilarity) < abs(second.second - targetSimilarity); })).first;
+		[&rank](const auto& first, const auto& second) {return rank(first) < rank(second); })).first;
+}
+
+Quality OptimizationSequence::LowestQualityAboveTarget() const
+{
+	auto lowest = Bracket().second;
+
+	return (lowest != m_optimizationResults.end()) ? lowest->first : BestQuality();
 }
 
 size_t OptimizationSequence::NumberOfIterations() const
@@ -22,5 +54,38 @@ size_t OptimizationSequence::NumberOfIterations() const
 
 bool OptimizationSequence::HasBeenTried(Quality quality) const
 {
-	return std::find_if(m_optimizationResults.begin(), m_optimizationResults.end(), [quality](auto const& item) {return item.first == quality; }) != m_optimizationResults.end();
+	return Find(quality) != m_optimizationResults.end();
+}
+
+bool OptimizationSequence::IsExact(Quality quality) const
+{
+	return std::find(m_estimates.begin(), m_estimates.end(), quality) == m_estimates.end();
+}
+
+std::pair<OptimizationSequence::const_iterator, OptimizationSequence::const_iterator> OptimizationSequence::Bracket() const
+{
+	auto below = m_optimizationResults.end();
+	auto above = m_optimizationResults.end();
+
+	for (auto result = m_optimizationResults.begin(); result != m_optimizationResults.end(); ++result)
+	{
+		if (result->second > m_targetSimilarity)
+		{
+			if (above == m_optimizationResults.end() || result->first < above->first)
+			{
+				above = result;
+			}
+		}
+		else if (below == m_optimizationResults.end() || result->first > below->first)
+		{
+			below = result;
+		}
+	}
+
+	return{ below, above };
+}
+
+OptimizationSequence::const_iterator OptimizationSequence::Find(Quality quality) const
+{
+	return std::find_if(m_optimizationResults.begin(), m_optimizationResults.end(), [quality](auto const& item) {return item.first == quality; });
 }
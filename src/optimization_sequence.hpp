@@ -18,11 +18,17 @@ public:
 	{
 	}
 
-	void AddOptimizationResult(Quality quality, ImageSimilarity::Similarity ssim);
+	// An inexact ssim is an early stop estimate, only its side of the target is known
+	void AddOptimizationResult(Quality quality, ImageSimilarity::Similarity ssim, bool exact = true);
+	void ReplaceEstimate(Quality quality, ImageSimilarity::Similarity ssim);
 
+	// Closest ssim to the target among the exact ones, estimates are only considered when there are no exact ones
 	Quality BestQuality() const;
+	// Lowest quality whose ssim is above the target, the best quality when none is
+	Quality LowestQualityAboveTarget() const;
 	size_t NumberOfIterations() const;
 	bool HasBeenTried(Quality quality) const;
+	bool IsExact(Quality quality) const;
 
 	using iterator = sequence_t::iterator;
 	using const_iterator = sequence_t::const_iterator;
@@ -32,7 +38,13 @@ public:
 	iterator end() { return m_optimizationResults.end(); }
 	const_iterator end() const { return m_optimizationResults.cend(); }
 
+	const_iterator Find(Quality quality) const;
+
+	// Highest quality below the target and lowest one above, end() when there is none
+	std::pair<const_iterator, const_iterator> Bracket() const;
+
 private:
 	sequence_t m_optimizationResults;
+	std::vector<Quality> m_estimates;
 	ImageSimilarity::Similarity m_targetSimilarity;
 };
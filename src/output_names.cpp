@@ -0,0 +1,127 @@
+#include "output_names.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+
+OutputNames::OutputNames(std::string suffix) : m_suffix{ std::move(suffix) }
+{
+}
+
+std::string OutputNames::Next(const std::string& imagePath)
+{
+	const fs::path path(imagePath);
+
+	std::shared_ptr<Folder> folder;
+	auto lock = listedFolder(path.parent_path().string(), folder);
+
+	const auto stem = path.stem().string();
+	const auto extension = path.extension().string();
+
+	const auto counter = folder->counters[key(stem, extension)]++;
+
+	return (path.parent_path() / (stem + m_suffix + std::to_string(counter) + extension)).string();
+}
+
+bool OutputNames::HasOutput(const std::string& imagePath)
+{
+	const fs::path path(imagePath);
+
+	std::shared_ptr<Folder> folder;
+	auto lock = listedFolder(path.parent_path().string(), folder);
+
+	const auto counter = folder->counters.find(key(path.stem().string(), path.extension().string()));
+
+	return counter != folder->counters.end() && counter->second > 0;
+}
+
+bool OutputNames::IsOutput(const std::string& path) const
+{
+	return suffixPosition(fs::path(path).stem().string()) != std::string::npos;
+}
+
+void OutputNames::Clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_folders.clear();
+}
+
+std::unique_lock<std::mutex> OutputNames::listedFolder(const std::string& folderPath, std::shared_ptr<Folder>& folder)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		auto& entry = m_folders[folderPath];
+
+		if (!entry)
+		{
+			entry = std::make_shared<Folder>();
+		}
+
+		folder = entry;
+	}
+
+	// Images of other folders don't wait on this listing
+	std::unique_lock<std::mutex> lock(folder->mutex);
+
+	if (!folder->listed)
+	{
+		list(folderPath, *folder);
+		folder->listed = true;
+	}
+
+	return lock;
+}
+
+// Reads the counter of every name made of a stem, the suffix and digits
+void OutputNames::list(const std::string& folderPath, Folder& folder) const
+{
+	std::error_code error;
+
+	for (fs::directory_iterator entry(folderPath.empty() ? "." : folderPath, error), end; !error && entry != end; entry.increment(error))
+	{
+		const auto& name = entry->path();
+		const auto stem = name.stem().string();
+
+		const auto position = suffixPosition(stem);
+
+		if (position == std::string::npos)
+		{
+			continue;
+		}
+
+		auto& counter = folder.counters[key(stem.substr(0, position), name.extension().string())];
+
+		counter = std::max(counter, std::stoull(stem.substr(position + m_suffix.size())) + 1);
+	}
+}
+
+std::string::size_type OutputNames::suffixPosition(const std::string& stem) const
+{
+	const auto position = stem.rfind(m_suffix);
+
+	if (position == std::string::npos)
+	{
+		return std::string::npos;
+	}
+
+	const auto digits = stem.substr(position + m_suffix.size());
+
+	// Beyond 18 digits the counter could overflow, such names are left to the commit to find
+	if (digits.empty() || digits.size() > 18 || !std::all_of(digits.begin(), digits.end(), [](unsigned char c) { return std::isdigit(c); }))
+	{
+		return std::string::npos;
+	}
+
+	return position;
+}
+
+std::string OutputNames::key(const std::string& stem, const std::string& extension)
+{
+	// A separator that can't appear in a file name
+	return stem + '/' + extension;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+
+// Names of the outputs: the image name with a suffix and a counter, like image_compressed0.jpg. Each folder is
+// listed once, the counters then come from memory, one past the highest one found or handed out for the image.
+// Files created by others since the listing are found when committing, the caller then asks for the next name
+class OutputNames
+{
+public:
+	explicit OutputNames(std::string suffix);
+
+	std::string Next(const std::string& imagePath);
+
+	// An output of the image was found in its folder or handed out since
+	bool HasOutput(const std::string& imagePath);
+
+	// The name is one of an output, whatever the image
+	bool IsOutput(const std::string& path) const;
+
+	// Forgets the listings, for files changed by others between runs
+	void Clear();
+
+private:
+	struct Folder
+	{
+		std::mutex mutex;
+		bool listed = false;
+
+		// Next counter for each image name and extension
+		std::unordered_map<std::string, unsigned long long> counters;
+	};
+
+	// Locked, and listed the first time
+	std::unique_lock<std::mutex> listedFolder(const std::string& folderPath, std::shared_ptr<Folder>& folder);
+	void list(const std::string& folderPath, Folder& folder) const;
+
+	// Where the suffix starts in the stem of an output, npos for other names
+	std::string::size_type suffixPosition(const std::string& stem) const;
+
+	static std::string key(const std::string& stem, const std::string& extension);
+
+	const std::string m_suffix;
+
+	std::mutex m_mutex;
+	std::unordered_map<std::string, std::shared_ptr<Folder>> m_folders;
+};
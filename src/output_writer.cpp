@@ -0,0 +1,630 @@
+#include "output_writer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace
+{
+	[[noreturn]] void throwError(const std::string& message)
+	{
+		throw std::runtime_error(message + ": " + std::strerror(errno));
+	}
+
+	std::string folderOf(const std::string& path)
+	{
+		auto folder = fs::path(path).parent_path();
+
+		return folder.empty() ? std::string(".") : folder.string();
+	}
+
+#ifndef _WIN32
+	struct Descriptor
+	{
+		int descriptor;
+
+		~Descriptor() { close(descriptor); }
+	};
+
+	void copyContent(int source, int destination)
+	{
+		std::vector<char> buffer(1 << 20);
+		off_t offset = 0;
+
+		while (true)
+		{
+			const auto count = pread(source, buffer.data(), buffer.size(), offset);
+
+			if (count < 0 && errno == EINTR)
+			{
+				continue;
+			}
+
+			if (count < 0)
+			{
+				throwError("Unable to copy");
+			}
+
+			if (count == 0)
+			{
+				return;
+			}
+
+			for (ssize_t written = 0; written < count;)
+			{
+				const auto result = write(destination, buffer.data() + written, static_cast<size_t>(count - written));
+
+				if (result < 0 && errno != EINTR)
+				{
+					throwError("Unable to copy");
+				}
+
+				written += std::max<ssize_t>(result, 0);
+			}
+
+			offset += count;
+		}
+	}
+
+	// 0 or the error. Linking by descriptor needs a capability, the /proc link of the descriptor works for everyone else
+	int linkDescriptor(int descriptor, const std::string& path)
+	{
+		if (linkat(descriptor, "", AT_FDCWD, path.c_str(), AT_EMPTY_PATH) == 0)
+		{
+			return 0;
+		}
+
+		if (errno != EEXIST)
+		{
+			const auto descriptorPath = "/proc/self/fd/" + std::to_string(descriptor);
+
+			if (linkat(AT_FDCWD, descriptorPath.c_str(), AT_FDCWD, path.c_str(), AT_SYMLINK_FOLLOW) == 0)
+			{
+				return 0;
+			}
+		}
+
+		return errno;
+	}
+
+	bool sameTime(const struct timespec& first, const struct timespec& second)
+	{
+		return first.tv_sec == second.tv_sec && first.tv_nsec == second.tv_nsec;
+	}
+
+	// Owner first, changing it clears the set-user-ID and set-group-ID bits
+	void copyAttributes(const struct stat& original, int descriptor, const std::string& imagePath)
+	{
+		struct stat status;
+
+		if (fstat(descriptor, &status) != 0)
+		{
+			throwError("Unable to replace " + imagePath);
+		}
+
+		if ((status.st_uid != original.st_uid || status.st_gid != original.st_gid) && fchown(descriptor, original.st_uid, original.st_gid) != 0)
+		{
+			throwError("Unable to keep the owner of " + imagePath);
+		}
+
+		if (fchmod(descriptor, original.st_mode & 07777) != 0)
+		{
+			throwError("Unable to keep the permissions of " + imagePath);
+		}
+
+#ifdef __APPLE__
+		const struct timespec times[2] = { original.st_atimespec, original.st_mtimespec };
+#else
+		const struct timespec times[2] = { original.st_atim, original.st_mtim };
+#endif
+
+		if (futimens(descriptor, times) != 0)
+		{
+			throwError("Unable to keep the times of " + imagePath);
+		}
+	}
+#endif
+}
+
+OutputWriter::PendingFile::~PendingFile()
+{
+	discard();
+}
+
+OutputWriter::PendingFile::PendingFile(PendingFile&& other) noexcept :
+	m_descriptor{ other.m_descriptor }, m_temporaryPath{ std::move(other.m_temporaryPath) }
+{
+	other.m_descriptor = -1;
+	other.m_temporaryPath.clear();
+}
+
+OutputWriter::PendingFile& OutputWriter::PendingFile::operator=(PendingFile&& other) noexcept
+{
+	if (this != &other)
+	{
+		discard();
+
+		m_descriptor = other.m_descriptor;
+		m_temporaryPath = std::move(other.m_temporaryPath);
+
+		other.m_descriptor = -1;
+		other.m_temporaryPath.clear();
+	}
+
+	return *this;
+}
+
+void OutputWriter::PendingFile::discard() noexcept
+{
+#ifndef _WIN32
+	if (m_descriptor >= 0)
+	{
+		close(m_descriptor);
+		m_descriptor = -1;
+	}
+#endif
+
+	if (!m_temporaryPath.empty())
+	{
+		std::error_code error;
+		fs::remove(m_temporaryPath, error);
+
+		m_temporaryPath.clear();
+	}
+}
+
+#ifdef _WIN32
+
+OutputWriter::PendingFile OutputWriter::Create(const std::string& outputLocation)
+{
+	PendingFile file;
+	file.m_temporaryPath = temporaryPath(outputLocation);
+
+	return file;
+}
+
+void OutputWriter::WriteAll(PendingFile& file, const uint8_t* data, size_t size)
+{
+	std::ofstream stream(file.m_temporaryPath, std::ios::binary);
+
+	if (!stream.write(reinterpret_cast<const char*>(data), size) || !stream.flush())
+	{
+		throw std::runtime_error("Unable to write " + file.m_temporaryPath);
+	}
+}
+
+bool OutputWriter::Commit(PendingFile& file, const std::string& outputPath)
+{
+	// Renaming fails when the destination exists on Windows
+	std::error_code error;
+	fs::rename(file.m_temporaryPath, outputPath, error);
+
+	if (error)
+	{
+		if (fs::exists(outputPath))
+		{
+			return false;
+		}
+
+		throw fs::filesystem_error("Unable to rename", file.m_temporaryPath, outputPath, error);
+	}
+
+	file.m_temporaryPath.clear();
+
+	return true;
+}
+
+void OutputWriter::Replace(PendingFile& file, const std::string& imagePath)
+{
+	if (fs::file_size(file.m_temporaryPath) >= fs::file_size(imagePath))
+	{
+		throw std::runtime_error("Unable to replace " + imagePath + ": the output isn't smaller");
+	}
+
+	fs::permissions(file.m_temporaryPath, fs::status(imagePath).permissions());
+	fs::last_write_time(file.m_temporaryPath, fs::last_write_time(imagePath));
+
+	// Renaming over an existing file replaces it with std::filesystem
+	fs::rename(file.m_temporaryPath, imagePath);
+
+	file.m_temporaryPath.clear();
+}
+
+OutputWriter::PendingFile OutputWriter::CloneOriginal(const std::string& imagePath, const std::string& outputLocation)
+{
+	auto file = Create(outputLocation);
+
+	fs::copy_file(imagePath, file.m_temporaryPath, fs::copy_options::overwrite_existing);
+
+	return file;
+}
+
+bool OutputWriter::LinkOriginal(const std::string& imagePath, const std::string& outputPath)
+{
+	std::error_code error;
+	fs::create_hard_link(imagePath, outputPath, error);
+
+	if (error)
+	{
+		if (fs::exists(outputPath))
+		{
+			return false;
+		}
+
+		throw fs::filesystem_error("Unable to link", imagePath, outputPath, error);
+	}
+
+	return true;
+}
+
+void OutputWriter::Sync()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_folders.clear();
+}
+
+#else
+
+OutputWriter::PendingFile OutputWriter::Create(const std::string& outputLocation)
+{
+	PendingFile file;
+
+#ifdef O_TMPFILE
+	// Not every file system supports it, those fail right away
+	if (m_anonymousFiles)
+	{
+		file.m_descriptor = open(folderOf(outputLocation).c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+
+		if (file.m_descriptor >= 0)
+		{
+			return file;
+		}
+	}
+#endif
+
+	createNamed(file, outputLocation);
+
+	return file;
+}
+
+// Created exclusively, a file someone else named like it is never touched
+void OutputWriter::createNamed(PendingFile& file, const std::string& path)
+{
+	while (true)
+	{
+		auto name = temporaryPath(path);
+
+		file.m_descriptor = open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+
+		if (file.m_descriptor >= 0)
+		{
+			file.m_temporaryPath = std::move(name);
+
+			return;
+		}
+
+		if (errno != EEXIST)
+		{
+			throwError("Unable to create " + name);
+		}
+	}
+}
+
+void OutputWriter::WriteAll(PendingFile& file, const uint8_t* data, size_t size)
+{
+	while (size > 0)
+	{
+		const auto count = write(file.m_descriptor, data, size);
+
+		if (count < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			throwError("Unable to write output");
+		}
+
+		data += count;
+		size -= static_cast<size_t>(count);
+	}
+}
+
+bool OutputWriter::Commit(PendingFile& file, const std::string& outputPath)
+{
+	if (!file.m_temporaryPath.empty())
+	{
+		if (!linkNamed(file, outputPath))
+		{
+			return false;
+		}
+	}
+	else
+	{
+		const int error = linkDescriptor(file.m_descriptor, outputPath);
+
+		if (error == EEXIST)
+		{
+			return false;
+		}
+
+		if (error != 0)
+		{
+			nameAnonymous(file, outputPath);
+
+			if (!linkNamed(file, outputPath))
+			{
+				return false;
+			}
+		}
+	}
+
+	const int descriptor = file.m_descriptor;
+	file.m_descriptor = -1;
+
+	if (close(descriptor) != 0)
+	{
+		throwError("Unable to write " + outputPath);
+	}
+
+	addFolder(outputPath);
+
+	return true;
+}
+
+bool OutputWriter::linkNamed(PendingFile& file, const std::string& outputPath)
+{
+	// A link can't replace the output like a rename would, file systems without links are renamed to
+	if (link(file.m_temporaryPath.c_str(), outputPath.c_str()) == 0)
+	{
+		unlink(file.m_temporaryPath.c_str());
+	}
+	else if (errno == EEXIST)
+	{
+		return false;
+	}
+#ifdef RENAME_NOREPLACE
+	else if (renameat2(AT_FDCWD, file.m_temporaryPath.c_str(), AT_FDCWD, outputPath.c_str(), RENAME_NOREPLACE) != 0)
+	{
+		if (errno == EEXIST)
+		{
+			return false;
+		}
+
+		throwError("Unable to rename to " + outputPath);
+	}
+#else
+	else if (rename(file.m_temporaryPath.c_str(), outputPath.c_str()) != 0)
+	{
+		throwError("Unable to rename to " + outputPath);
+	}
+#endif
+
+	file.m_temporaryPath.clear();
+
+	return true;
+}
+
+// The data is already written, it is copied to a named file this time and later files get named ones directly
+void OutputWriter::nameAnonymous(PendingFile& file, const std::string& imagePath)
+{
+	m_anonymousFiles = false;
+
+	PendingFile named;
+	createNamed(named, imagePath);
+
+	copyContent(file.m_descriptor, named.m_descriptor);
+
+	file = std::move(named);
+}
+
+void OutputWriter::Replace(PendingFile& file, const std::string& imagePath)
+{
+	struct stat original;
+	struct stat replacement;
+
+	if (lstat(imagePath.c_str(), &original) != 0 || fstat(file.m_descriptor, &replacement) != 0)
+	{
+		throwError("Unable to replace " + imagePath);
+	}
+
+	// A link would be replaced by a file rather than its target
+	if (!S_ISREG(original.st_mode))
+	{
+		throw std::runtime_error("Unable to replace " + imagePath + ": not a regular file");
+	}
+
+	if (replacement.st_size >= original.st_size)
+	{
+		throw std::runtime_error("Unable to replace " + imagePath + ": the output isn't smaller");
+	}
+
+	// Named first, only a named file can be exchanged with the image
+	while (file.m_temporaryPath.empty())
+	{
+		auto name = temporaryPath(imagePath);
+		const int error = linkDescriptor(file.m_descriptor, name);
+
+		if (error == 0)
+		{
+			file.m_temporaryPath = std::move(name);
+		}
+		else if (error != EEXIST)
+		{
+			nameAnonymous(file, imagePath);
+		}
+	}
+
+	copyAttributes(original, file.m_descriptor, imagePath);
+
+	bool exchanged = false;
+
+#ifdef RENAME_EXCHANGE
+	// Exchanged rather than renamed over, so the file replaced can be checked to be the one the attributes are from
+	exchanged = renameat2(AT_FDCWD, file.m_temporaryPath.c_str(), AT_FDCWD, imagePath.c_str(), RENAME_EXCHANGE) == 0;
+
+	if (!exchanged && errno != EINVAL && errno != ENOSYS)
+	{
+		throwError("Unable to replace " + imagePath);
+	}
+#endif
+
+	if (exchanged)
+	{
+		struct stat replaced;
+
+#ifdef __APPLE__
+		const auto& modified = original.st_mtimespec;
+		const auto& replacedModified = replaced.st_mtimespec;
+#else
+		const auto& modified = original.st_mtim;
+		const auto& replacedModified = replaced.st_mtim;
+#endif
+
+		if (lstat(file.m_temporaryPath.c_str(), &replaced) != 0 || replaced.st_ino != original.st_ino || replaced.st_size != original.st_size || !sameTime(replacedModified, modified))
+		{
+			renameat2(AT_FDCWD, file.m_temporaryPath.c_str(), AT_FDCWD, imagePath.c_str(), RENAME_EXCHANGE);
+
+			throw std::runtime_error("Unable to replace " + imagePath + ": changed while being replaced");
+		}
+
+		// The temporary name holds the original now
+		unlink(file.m_temporaryPath.c_str());
+	}
+	else if (rename(file.m_temporaryPath.c_str(), imagePath.c_str()) != 0)
+	{
+		throwError("Unable to replace " + imagePath);
+	}
+
+	file.m_temporaryPath.clear();
+
+	const int descriptor = file.m_descriptor;
+	file.m_descriptor = -1;
+
+	if (close(descriptor) != 0)
+	{
+		throwError("Unable to write " + imagePath);
+	}
+
+	addFolder(imagePath);
+}
+
+OutputWriter::PendingFile OutputWriter::CloneOriginal(const std::string& imagePath, const std::string& outputLocation)
+{
+	const Descriptor source{ open(imagePath.c_str(), O_RDONLY | O_CLOEXEC) };
+
+	if (source.descriptor < 0)
+	{
+		throwError("Unable to open " + imagePath);
+	}
+
+	auto file = Create(outputLocation);
+
+#ifdef FICLONE
+	if (ioctl(file.m_descriptor, FICLONE, source.descriptor) != 0)
+#endif
+	{
+		copyContent(source.descriptor, file.m_descriptor);
+	}
+
+	return file;
+}
+
+bool OutputWriter::LinkOriginal(const std::string& imagePath, const std::string& outputPath)
+{
+	if (link(imagePath.c_str(), outputPath.c_str()) != 0)
+	{
+		if (errno == EEXIST)
+		{
+			return false;
+		}
+
+		if (errno == EXDEV)
+		{
+			auto file = CloneOriginal(imagePath, outputPath);
+
+			return Commit(file, outputPath);
+		}
+
+		throwError("Unable to link " + imagePath);
+	}
+
+	addFolder(outputPath);
+
+	return true;
+}
+
+// One syncfs per file system rather than one fsync per file, the folder entries of the links are synced with it
+void OutputWriter::Sync()
+{
+	std::set<std::string> folders;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		folders.swap(m_folders);
+	}
+
+#ifdef __linux__
+	std::set<dev_t> devices;
+
+	for (const auto& folder : folders)
+	{
+		const Descriptor descriptor{ open(folder.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC) };
+		struct stat status;
+
+		if (descriptor.descriptor < 0 || fstat(descriptor.descriptor, &status) != 0)
+		{
+			throwError("Unable to sync " + folder);
+		}
+
+		if (devices.insert(status.st_dev).second && syncfs(descriptor.descriptor) != 0)
+		{
+			throwError("Unable to sync " + folder);
+		}
+	}
+#else
+	if (!folders.empty())
+	{
+		sync();
+	}
+#endif
+}
+
+#endif
+
+// Not a jpeg extension, so the folder walk never takes it for an image. Unique to the writer, the process id
+// keeps the names of concurrent runs apart
+std::string OutputWriter::temporaryPath(const std::string& path)
+{
+#ifdef _WIN32
+	return path + "." + std::to_string(m_temporaryFiles++) + ".tmp";
+#else
+	return path + "." + std::to_string(getpid()) + "-" + std::to_string(m_temporaryFiles++) + ".tmp";
+#endif
+}
+
+void OutputWriter::addFolder(const std::string& outputPath)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_folders.insert(folderOf(outputPath));
+}
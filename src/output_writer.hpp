@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+
+
+// Writes the outputs so they only ever appear complete under their final name: as anonymous files linked
+// into their folder once written where O_TMPFILE is supported, through a temporary name otherwise.
+// An output never replaces an existing file, committing to a name already taken fails and another can be tried.
+// Nothing is synced per file, Sync makes everything durable with one call per file system
+class OutputWriter
+{
+public:
+	// Open file that only becomes an output once committed, it is removed if it never is
+	class PendingFile
+	{
+	public:
+		PendingFile() = default;
+		~PendingFile();
+
+		PendingFile(PendingFile&& other) noexcept;
+		PendingFile& operator=(PendingFile&& other) noexcept;
+
+		PendingFile(const PendingFile&) = delete;
+		PendingFile& operator=(const PendingFile&) = delete;
+
+		// -1 on Windows, where the data is written by path
+		int Descriptor() const { return m_descriptor; }
+
+	private:
+		friend class OutputWriter;
+
+		void discard() noexcept;
+
+		int m_descriptor = -1;
+
+		// Empty for anonymous files
+		std::string m_temporaryPath;
+	};
+
+	// In the folder of the output location, the image path or its mirror in another folder. A temporary name
+	// is derived from it where one is needed
+	PendingFile Create(const std::string& outputLocation);
+
+	static void WriteAll(PendingFile& file, const uint8_t* data, size_t size);
+
+	// False when the output path is taken, the file is then still pending
+	bool Commit(PendingFile& file, const std::string& outputPath);
+
+	// Takes the place of the image with its owner, permissions and times, only when it is smaller than the image on disk.
+	// Other hard links to the image keep the original. The file is still pending when it throws
+	void Replace(PendingFile& file, const std::string& imagePath);
+
+	// A pending file with the content of the original, sharing its data where the file system can (reflink)
+	PendingFile CloneOriginal(const std::string& imagePath, const std::string& outputLocation);
+
+	// False when the output path is taken. The output is then the same file as the original, changing one changes both.
+	// On another file system it is cloned instead
+	bool LinkOriginal(const std::string& imagePath, const std::string& outputPath);
+
+	// Makes the outputs committed since the last call durable
+	void Sync();
+
+private:
+	void createNamed(PendingFile& file, const std::string& path);
+	bool linkNamed(PendingFile& file, const std::string& outputPath);
+	void nameAnonymous(PendingFile& file, const std::string& imagePath);
+	std::string temporaryPath(const std::string& path);
+	void addFolder(const std::string& outputPath);
+
+	// Cleared the first time an anonymous file can't be linked, without /proc or the capability to link by descriptor
+	std::atomic<bool> m_anonymousFiles{ true };
+
+	std::atomic<unsigned long long> m_temporaryFiles{ 0 };
+
+	std::mutex m_mutex;
+	std::set<std::string> m_folders;
+};
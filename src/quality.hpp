@@ -2,6 +2,10 @@
 
 using Quality = unsigned int;
 
+// Range searched when nothing is known about the source
+constexpr Quality MINIMUM_QUALITY = 50;
+constexpr Quality MAXIMUM_QUALITY = 100;
+
 class  QualityRange
 {
 public:
@@ -0,0 +1,342 @@
+#include "result_cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace
+{
+	const char s_magic[8] = { 'i', 'O', 'p', 't', 'C', 'a', 'c', '2' };
+
+	// First format, with results only
+	const char s_magicVersion1[8] = { 'i', 'O', 'p', 't', 'C', 'a', 'c', '1' };
+
+	struct RecordVersion1
+	{
+		uint64_t contentHash;
+		uint32_t similarityBits;
+		uint32_t quality;
+		uint64_t originalSize;
+		uint64_t compressedSize;
+	};
+
+	static_assert(sizeof(RecordVersion1) == 32, "Records must not be padded");
+
+	constexpr uint32_t EMPTY_SLOT = 0;
+	constexpr size_t MINIMUM_SLOTS = 1024;
+}
+
+ResultCache::ResultCache(const std::string& cachePath)
+{
+	const bool hasHeader = load(cachePath);
+
+	m_file = std::fopen(cachePath.c_str(), "ab");
+
+	if (m_file == nullptr)
+	{
+		throw std::runtime_error("Can't open result cache " + cachePath);
+	}
+
+	if (!hasHeader)
+	{
+		std::fwrite(s_magic, 1, sizeof(s_magic), m_file);
+		std::fflush(m_file);
+	}
+}
+
+ResultCache::~ResultCache()
+{
+	if (m_file != nullptr)
+	{
+		std::fclose(m_file);
+	}
+}
+
+std::optional<ResultCache::FileIdentity> ResultCache::Identify(const std::string& path)
+{
+#ifdef _WIN32
+	(void)path;
+
+	return std::nullopt;
+#else
+	struct stat status;
+
+	if (stat(path.c_str(), &status) != 0)
+	{
+		return std::nullopt;
+	}
+
+#ifdef __APPLE__
+	const auto& modified = status.st_mtimespec;
+#else
+	const auto& modified = status.st_mtim;
+#endif
+
+	return FileIdentity{ static_cast<uint64_t>(status.st_dev), static_cast<uint64_t>(status.st_ino), static_cast<uint64_t>(status.st_size),
+		static_cast<uint64_t>(modified.tv_sec) * 1000000000ULL + static_cast<uint64_t>(modified.tv_nsec) };
+#endif
+}
+
+std::optional<ResultCache::Entry> ResultCache::Find(uint64_t contentHash, ImageSimilarity::Similarity similarity) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	const Record* record = find({ Result, similarityBits(similarity), contentHash, {} });
+
+	if (record == nullptr)
+	{
+		return std::nullopt;
+	}
+
+	return Entry{ static_cast<Quality>(record->fields[0]), { record->fields[1], record->fields[2] } };
+}
+
+std::optional<uint64_t> ResultCache::FindContentHash(const FileIdentity& identity) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	const Record* record = find({ File, 0, 0, { identity.device, identity.inode, 0, 0 } });
+
+	if (record == nullptr || record->fields[2] != identity.size || record->fields[3] != identity.modificationTime)
+	{
+		return std::nullopt;
+	}
+
+	return record->contentHash;
+}
+
+void ResultCache::Add(uint64_t contentHash, ImageSimilarity::Similarity similarity, const Entry& entry)
+{
+	append({ Result, similarityBits(similarity), contentHash, { entry.quality, entry.result.GetOriginalSize(), entry.result.GetCompressedSize(), 0 } });
+}
+
+void ResultCache::AddFile(const FileIdentity& identity, uint64_t contentHash)
+{
+	append({ File, 0, contentHash, { identity.device, identity.inode, identity.size, identity.modificationTime } });
+}
+
+size_t ResultCache::Size() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_results.size;
+}
+
+uint32_t ResultCache::similarityBits(ImageSimilarity::Similarity similarity)
+{
+	const float value = similarity.GetValue();
+
+	uint32_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+
+	return bits;
+}
+
+bool ResultCache::sameKey(const Record& first, const Record& second)
+{
+	if (first.kind == Result)
+	{
+		return first.contentHash == second.contentHash && first.similarityBits == second.similarityBits;
+	}
+
+	return first.fields[0] == second.fields[0] && first.fields[1] == second.fields[1];
+}
+
+// Content hashes are uniform already, inodes are mixed first
+uint64_t ResultCache::slotHash(const Record& record)
+{
+	if (record.kind == Result)
+	{
+		return record.contentHash;
+	}
+
+	const uint64_t mixed = (record.fields[1] ^ (record.fields[0] << 32)) * 0x9E3779B97F4A7C15ULL;
+
+	return mixed ^ (mixed >> 29);
+}
+
+// A single read of the whole file into the records
+bool ResultCache::load(const std::string& cachePath)
+{
+	std::error_code error;
+	const auto fileSize = fs::file_size(cachePath, error);
+
+	if (error || fileSize == 0)
+	{
+		rehash(Result, MINIMUM_SLOTS);
+		rehash(File, MINIMUM_SLOTS);
+		return false;
+	}
+
+	std::FILE* file = std::fopen(cachePath.c_str(), "rb");
+
+	if (file == nullptr)
+	{
+		throw std::runtime_error("Can't read result cache " + cachePath);
+	}
+
+	char magic[sizeof(s_magic)];
+
+	if (std::fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+		(std::memcmp(magic, s_magic, sizeof(s_magic)) != 0 && std::memcmp(magic, s_magicVersion1, sizeof(s_magicVersion1)) != 0))
+	{
+		std::fclose(file);
+		throw std::runtime_error(cachePath + " is not a result cache");
+	}
+
+	if (std::memcmp(magic, s_magicVersion1, sizeof(s_magicVersion1)) == 0)
+	{
+		convertVersion1(file, fileSize, cachePath);
+
+		return true;
+	}
+
+	m_records.resize((fileSize - sizeof(s_magic)) / sizeof(Record));
+	m_records.resize(std::fread(m_records.data(), sizeof(Record), m_records.size(), file));
+
+	std::fclose(file);
+
+	rehash(Result, std::max(MINIMUM_SLOTS, 2 * m_records.size()));
+	rehash(File, std::max(MINIMUM_SLOTS, 2 * m_records.size()));
+
+	// A record cut short by an interrupted run would misalign everything appended after it
+	const auto validSize = sizeof(s_magic) + m_records.size() * sizeof(Record);
+
+	if (validSize != fileSize)
+	{
+		fs::resize_file(cachePath, validSize);
+	}
+
+	return true;
+}
+
+// Keeps the results and rewrites the file in the current format, the records of a cut short write are dropped
+void ResultCache::convertVersion1(std::FILE* file, size_t fileSize, const std::string& cachePath)
+{
+	std::vector<RecordVersion1> records((fileSize - sizeof(s_magicVersion1)) / sizeof(RecordVersion1));
+	records.resize(std::fread(records.data(), sizeof(RecordVersion1), records.size(), file));
+
+	std::fclose(file);
+
+	m_records.reserve(records.size());
+
+	for (const auto& record : records)
+	{
+		m_records.push_back({ Result, record.similarityBits, record.contentHash, { record.quality, record.originalSize, record.compressedSize, 0 } });
+	}
+
+	rehash(Result, std::max(MINIMUM_SLOTS, 2 * m_records.size()));
+	rehash(File, MINIMUM_SLOTS);
+
+	std::FILE* converted = std::fopen(cachePath.c_str(), "wb");
+
+	if (converted == nullptr)
+	{
+		throw std::runtime_error("Can't write result cache " + cachePath);
+	}
+
+	const bool written = std::fwrite(s_magic, 1, sizeof(s_magic), converted) == sizeof(s_magic) &&
+		std::fwrite(m_records.data(), sizeof(Record), m_records.size(), converted) == m_records.size();
+
+	if (std::fclose(converted) != 0 || !written)
+	{
+		throw std::runtime_error("Can't write result cache " + cachePath);
+	}
+
+	m_converted = true;
+}
+
+const ResultCache::Record* ResultCache::find(const Record& key) const
+{
+	const auto& slots = indexOf(key.kind).slots;
+	const size_t mask = slots.size() - 1;
+
+	for (size_t slot = slotHash(key) & mask; slots[slot] != EMPTY_SLOT; slot = (slot + 1) & mask)
+	{
+		const Record& record = m_records[slots[slot] - 1];
+
+		if (sameKey(record, key))
+		{
+			return &record;
+		}
+	}
+
+	return nullptr;
+}
+
+void ResultCache::append(const Record& record)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_records.push_back(record);
+	index(static_cast<uint32_t>(m_records.size() - 1));
+
+	std::fwrite(&record, sizeof(record), 1, m_file);
+	std::fflush(m_file);
+}
+
+// Linear probing, a record with the key of an indexed one takes over its slot
+void ResultCache::index(uint32_t record)
+{
+	const Record& added = m_records[record];
+
+	if (added.kind != Result && added.kind != File)
+	{
+		return;
+	}
+
+	auto& index = indexOf(added.kind);
+
+	if (2 * (index.size + 1) > index.slots.size())
+	{
+		rehash(added.kind, 2 * index.slots.size());
+		return;
+	}
+
+	const size_t mask = index.slots.size() - 1;
+
+	size_t slot = slotHash(added) & mask;
+
+	for (; index.slots[slot] != EMPTY_SLOT; slot = (slot + 1) & mask)
+	{
+		if (sameKey(m_records[index.slots[slot] - 1], added))
+		{
+			index.slots[slot] = record + 1;
+			return;
+		}
+	}
+
+	index.slots[slot] = record + 1;
+	index.size++;
+}
+
+// Rebuilds the table from the records of its kind, in file order so the latest record of a key wins
+void ResultCache::rehash(RecordKind kind, size_t slots)
+{
+	auto& index = indexOf(kind);
+
+	size_t capacity = 1;
+
+	while (capacity < slots)
+	{
+		capacity *= 2;
+	}
+
+	index.slots.assign(capacity, EMPTY_SLOT);
+	index.size = 0;
+
+	for (size_t record = 0; record < m_records.size(); record++)
+	{
+		if (m_records[record].kind == kind)
+		{
+			this->index(static_cast<uint32_t>(record));
+		}
+	}
+}
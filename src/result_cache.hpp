@@ -0,0 +1,116 @@
+#pragma once
+
+#include "iopt/image_similarity.hpp"
+#include "iopt/optimization_result.hpp"
+#include "quality.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+
+// Results of previous runs, keyed by the hash of the file content and the target similarity, along with
+// the content hash last seen for each file so unchanged files are recognized from their metadata alone.
+// The file is a header followed by fixed size records that are only ever appended, a later record
+// for the same key replaces the earlier ones
+class ResultCache
+{
+public:
+	struct Entry
+	{
+		// 0 when the original was kept
+		Quality quality;
+		OptimizationResult result;
+	};
+
+	// What tells a file and its version apart without reading it
+	struct FileIdentity
+	{
+		uint64_t device;
+		uint64_t inode;
+		uint64_t size;
+		uint64_t modificationTime;
+	};
+
+	// Loads the records in the file, creating it when it doesn't exist
+	explicit ResultCache(const std::string& cachePath);
+	~ResultCache();
+
+	ResultCache(const ResultCache&) = delete;
+	ResultCache& operator=(const ResultCache&) = delete;
+
+	// From stat, with the modification time in nanoseconds. Not available on Windows, where files are always hashed
+	static std::optional<FileIdentity> Identify(const std::string& path);
+
+	std::optional<Entry> Find(uint64_t contentHash, ImageSimilarity::Similarity similarity) const;
+
+	// Only when size and modification time still match the ones recorded for the device and inode
+	std::optional<uint64_t> FindContentHash(const FileIdentity& identity) const;
+
+	// Written to the file right away, so an interrupted run keeps what it has done
+	void Add(uint64_t contentHash, ImageSimilarity::Similarity similarity, const Entry& entry);
+	void AddFile(const FileIdentity& identity, uint64_t contentHash);
+
+	size_t Size() const;
+
+	// The file was written by an earlier version: its results were kept and it was rewritten in the current format
+	bool WasConverted() const { return m_converted; }
+
+private:
+	enum RecordKind : uint32_t
+	{
+		Result,
+		File
+	};
+
+	// On disk layout, native byte order
+	struct Record
+	{
+		RecordKind kind;
+		uint32_t similarityBits;
+		uint64_t contentHash;
+
+		// Result: quality, original size, compressed size, unused
+		// File: device, inode, size, modification time
+		uint64_t fields[4];
+	};
+
+	static_assert(sizeof(Record) == 48, "Records must not be padded");
+
+	// Open addressing table of record indices + 1, 0 is an empty slot
+	struct Index
+	{
+		std::vector<uint32_t> slots;
+		size_t size = 0;
+	};
+
+	static uint32_t similarityBits(ImageSimilarity::Similarity similarity);
+	static bool sameKey(const Record& first, const Record& second);
+	static uint64_t slotHash(const Record& record);
+
+	// False when there is no file yet
+	bool load(const std::string& cachePath);
+	void convertVersion1(std::FILE* file, size_t fileSize, const std::string& cachePath);
+
+	const Record* find(const Record& key) const;
+	void append(const Record& record);
+	void index(uint32_t record);
+	void rehash(RecordKind kind, size_t slots);
+
+	Index& indexOf(RecordKind kind) { return kind == Result ? m_results : m_files; }
+	const Index& indexOf(RecordKind kind) const { return kind == Result ? m_results : m_files; }
+
+	mutable std::mutex m_mutex;
+
+	// The records are read from the file straight into this vector, the indices on top of it
+	// avoid an allocation per entry, so even millions of them load quickly
+	std::vector<Record> m_records;
+	Index m_results;
+	Index m_files;
+
+	std::FILE* m_file = nullptr;
+	bool m_converted = false;
+};
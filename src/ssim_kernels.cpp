@@ -0,0 +1,391 @@
+#include "ssim_kernels.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define IOPT_X86_SIMD
+	#define IOPT_TARGET(isa) __attribute__((target(isa)))
+	#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	#define IOPT_X86_SIMD
+	#define IOPT_TARGET(isa)
+	#include <immintrin.h>
+	#include <intrin.h>
+#endif
+
+
+namespace ImageSimilarity
+{
+	namespace kernels
+	{
+		constexpr int L = 255;
+		constexpr float K1 = 0.01f;
+		constexpr float K2 = 0.03f;
+
+		constexpr float C1 = (K1*L) * (K1*L);
+		constexpr float C2 = (K2*L) * (K2*L);
+
+		void convertToFloatScalar(const uint8_t* source, float* destination, size_t count)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				destination[i] = static_cast<float>(source[i]);
+			}
+		}
+
+		void productsScalar(const float* ref, const float* cmp, float* refSquared, float* cmpSquared, float* both, size_t count)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				refSquared[i] = ref[i] * ref[i];
+				cmpSquared[i] = cmp[i] * cmp[i];
+				both[i] = ref[i] * cmp[i];
+			}
+		}
+
+		inline float windowSsim(float refSum, float cmpSum, float refSquaredSum, float cmpSquaredSum, float bothSum, float norm)
+		{
+			float ref_mu = refSum * norm;
+			float cmp_mu = cmpSum * norm;
+
+			float ref_mu_sq = ref_mu * ref_mu;
+			float cmp_mu_sq = cmp_mu * cmp_mu;
+
+			float ref_sigma_sqd_value = refSquaredSum * norm - ref_mu_sq;
+			float cmp_sigma_sqd_value = cmpSquaredSum * norm - cmp_mu_sq;
+
+			float denominator = (ref_mu_sq + cmp_mu_sq + C1) * (ref_sigma_sqd_value + cmp_sigma_sqd_value + C2);
+
+			float sigma_both_value = bothSum * norm - ref_mu * cmp_mu;
+
+			float numerator = (2.0f * ref_mu * cmp_mu + C1) * (2.0f * sigma_both_value + C2);
+
+			return numerator / denominator;
+		}
+
+		double ssimSumScalar(const float* refSum, const float* cmpSum, const float* refSquaredSum, const float* cmpSquaredSum, const float* bothSum, size_t count, float norm)
+		{
+			double ssim_sum = 0.0;
+
+			for (size_t i = 0; i < count; i++)
+			{
+				ssim_sum += windowSsim(refSum[i], cmpSum[i], refSquaredSum[i], cmpSquaredSum[i], bothSum[i], norm);
+			}
+
+			return ssim_sum;
+		}
+
+#ifdef IOPT_X86_SIMD
+
+		// SSE4.1, 4 lanes
+
+		IOPT_TARGET("sse4.1")
+		void convertToFloatSse41(const uint8_t* source, float* destination, size_t count)
+		{
+			size_t i = 0;
+
+			for (; i + 16 <= count; i += 16)
+			{
+				__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+
+				_mm_storeu_ps(destination + i, _mm_cvtepi32_ps(_mm_cvtepu8_epi32(bytes)));
+				_mm_storeu_ps(destination + i + 4, _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4))));
+				_mm_storeu_ps(destination + i + 8, _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(bytes, 8))));
+				_mm_storeu_ps(destination + i + 12, _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(bytes, 12))));
+			}
+
+			convertToFloatScalar(source + i, destination + i, count - i);
+		}
+
+		IOPT_TARGET("sse4.1")
+		void productsSse41(const float* ref, const float* cmp, float* refSquared, float* cmpSquared, float* both, size_t count)
+		{
+			size_t i = 0;
+
+			for (; i + 4 <= count; i += 4)
+			{
+				__m128 r = _mm_loadu_ps(ref + i);
+				__m128 c = _mm_loadu_ps(cmp + i);
+
+				_mm_storeu_ps(refSquared + i, _mm_mul_ps(r, r));
+				_mm_storeu_ps(cmpSquared + i, _mm_mul_ps(c, c));
+				_mm_storeu_ps(both + i, _mm_mul_ps(r, c));
+			}
+
+			productsScalar(ref + i, cmp + i, refSquared + i, cmpSquared + i, both + i, count - i);
+		}
+
+		IOPT_TARGET("sse4.1")
+		double ssimSumSse41(const float* refSum, const float* cmpSum, const float* refSquaredSum, const float* cmpSquaredSum, const float* bothSum, size_t count, float norm)
+		{
+			const __m128 vnorm = _mm_set1_ps(norm);
+			const __m128 vc1 = _mm_set1_ps(C1);
+			const __m128 vc2 = _mm_set1_ps(C2);
+			const __m128 vtwo = _mm_set1_ps(2.0f);
+
+			__m128d accumulator = _mm_setzero_pd();
+
+			size_t i = 0;
+
+			for (; i + 4 <= count; i += 4)
+			{
+				__m128 ref_mu = _mm_mul_ps(_mm_loadu_ps(refSum + i), vnorm);
+				__m128 cmp_mu = _mm_mul_ps(_mm_loadu_ps(cmpSum + i), vnorm);
+
+				__m128 ref_mu_sq = _mm_mul_ps(ref_mu, ref_mu);
+				__m128 cmp_mu_sq = _mm_mul_ps(cmp_mu, cmp_mu);
+				__m128 mu_both = _mm_mul_ps(ref_mu, cmp_mu);
+
+				__m128 ref_sigma_sqd = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(refSquaredSum + i), vnorm), ref_mu_sq);
+				__m128 cmp_sigma_sqd = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(cmpSquaredSum + i), vnorm), cmp_mu_sq);
+				__m128 sigma_both = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(bothSum + i), vnorm), mu_both);
+
+				__m128 denominator = _mm_mul_ps(_mm_add_ps(_mm_add_ps(ref_mu_sq, cmp_mu_sq), vc1), _mm_add_ps(_mm_add_ps(ref_sigma_sqd, cmp_sigma_sqd), vc2));
+				__m128 numerator = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(vtwo, mu_both), vc1), _mm_add_ps(_mm_mul_ps(vtwo, sigma_both), vc2));
+
+				__m128 ratio = _mm_div_ps(numerator, denominator);
+
+				accumulator = _mm_add_pd(accumulator, _mm_cvtps_pd(ratio));
+				accumulator = _mm_add_pd(accumulator, _mm_cvtps_pd(_mm_movehl_ps(ratio, ratio)));
+			}
+
+			double lanes[2];
+			_mm_storeu_pd(lanes, accumulator);
+
+			return lanes[0] + lanes[1] + ssimSumScalar(refSum + i, cmpSum + i, refSquaredSum + i, cmpSquaredSum + i, bothSum + i, count - i, norm);
+		}
+
+		// AVX2, 8 lanes
+
+		IOPT_TARGET("avx2")
+		void convertToFloatAvx2(const uint8_t* source, float* destination, size_t count)
+		{
+			size_t i = 0;
+
+			for (; i + 16 <= count; i += 16)
+			{
+				__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+
+				_mm256_storeu_ps(destination + i, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes)));
+				_mm256_storeu_ps(destination + i + 8, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8))));
+			}
+
+			convertToFloatScalar(source + i, destination + i, count - i);
+		}
+
+		IOPT_TARGET("avx2")
+		void productsAvx2(const float* ref, const float* cmp, float* refSquared, float* cmpSquared, float* both, size_t count)
+		{
+			size_t i = 0;
+
+			for (; i + 8 <= count; i += 8)
+			{
+				__m256 r = _mm256_loadu_ps(ref + i);
+				__m256 c = _mm256_loadu_ps(cmp + i);
+
+				_mm256_storeu_ps(refSquared + i, _mm256_mul_ps(r, r));
+				_mm256_storeu_ps(cmpSquared + i, _mm256_mul_ps(c, c));
+				_mm256_storeu_ps(both + i, _mm256_mul_ps(r, c));
+			}
+
+			productsScalar(ref + i, cmp + i, refSquared + i, cmpSquared + i, both + i, count - i);
+		}
+
+		IOPT_TARGET("avx2")
+		double ssimSumAvx2(const float* refSum, const float* cmpSum, const float* refSquaredSum, const float* cmpSquaredSum, const float* bothSum, size_t count, float norm)
+		{
+			const __m256 vnorm = _mm256_set1_ps(norm);
+			const __m256 vc1 = _mm256_set1_ps(C1);
+			const __m256 vc2 = _mm256_set1_ps(C2);
+			const __m256 vtwo = _mm256_set1_ps(2.0f);
+
+			__m256d accumulator = _mm256_setzero_pd();
+
+			size_t i = 0;
+
+			for (; i + 8 <= count; i += 8)
+			{
+				__m256 ref_mu = _mm256_mul_ps(_mm256_loadu_ps(refSum + i), vnorm);
+				__m256 cmp_mu = _mm256_mul_ps(_mm256_loadu_ps(cmpSum + i), vnorm);
+
+				__m256 ref_mu_sq = _mm256_mul_ps(ref_mu, ref_mu);
+				__m256 cmp_mu_sq = _mm256_mul_ps(cmp_mu, cmp_mu);
+				__m256 mu_both = _mm256_mul_ps(ref_mu, cmp_mu);
+
+				__m256 ref_sigma_sqd = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(refSquaredSum + i), vnorm), ref_mu_sq);
+				__m256 cmp_sigma_sqd = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(cmpSquaredSum + i), vnorm), cmp_mu_sq);
+				__m256 sigma_both = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(bothSum + i), vnorm), mu_both);
+
+				__m256 denominator = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(ref_mu_sq, cmp_mu_sq), vc1), _mm256_add_ps(_mm256_add_ps(ref_sigma_sqd, cmp_sigma_sqd), vc2));
+				__m256 numerator = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(vtwo, mu_both), vc1), _mm256_add_ps(_mm256_mul_ps(vtwo, sigma_both), vc2));
+
+				__m256 ratio = _mm256_div_ps(numerator, denominator);
+
+				accumulator = _mm256_add_pd(accumulator, _mm256_cvtps_pd(_mm256_castps256_ps128(ratio)));
+				accumulator = _mm256_add_pd(accumulator, _mm256_cvtps_pd(_mm256_extractf128_ps(ratio, 1)));
+			}
+
+			double lanes[4];
+			_mm256_storeu_pd(lanes, accumulator);
+
+			return lanes[0] + lanes[1] + lanes[2] + lanes[3] + ssimSumScalar(refSum + i, cmpSum + i, refSquaredSum + i, cmpSquaredSum + i, bothSum + i, count - i, norm);
+		}
+
+		// AVX-512F, 16 lanes
+
+		IOPT_TARGET("avx512f")
+		void convertToFloatAvx512(const uint8_t* source, float* destination, size_t count)
+		{
+			size_t i = 0;
+
+			for (; i + 16 <= count; i += 16)
+			{
+				__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+
+				_mm512_storeu_ps(destination + i, _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(bytes)));
+			}
+
+			convertToFloatScalar(source + i, destination + i, count - i);
+		}
+
+		IOPT_TARGET("avx512f")
+		void productsAvx512(const float* ref, const float* cmp, float* refSquared, float* cmpSquared, float* both, size_t count)
+		{
+			size_t i = 0;
+
+			for (; i + 16 <= count; i += 16)
+			{
+				__m512 r = _mm512_loadu_ps(ref + i);
+				__m512 c = _mm512_loadu_ps(cmp + i);
+
+				_mm512_storeu_ps(refSquared + i, _mm512_mul_ps(r, r));
+				_mm512_storeu_ps(cmpSquared + i, _mm512_mul_ps(c, c));
+				_mm512_storeu_ps(both + i, _mm512_mul_ps(r, c));
+			}
+
+			productsScalar(ref + i, cmp + i, refSquared + i, cmpSquared + i, both + i, count - i);
+		}
+
+		IOPT_TARGET("avx512f")
+		double ssimSumAvx512(const float* refSum, const float* cmpSum, const float* refSquaredSum, const float* cmpSquaredSum, const float* bothSum, size_t count, float norm)
+		{
+			const __m512 vnorm = _mm512_set1_ps(norm);
+			const __m512 vc1 = _mm512_set1_ps(C1);
+			const __m512 vc2 = _mm512_set1_ps(C2);
+			const __m512 vtwo = _mm512_set1_ps(2.0f);
+
+			__m512d accumulator = _mm512_setzero_pd();
+
+			size_t i = 0;
+
+			for (; i + 16 <= count; i += 16)
+			{
+				__m512 ref_mu = _mm512_mul_ps(_mm512_loadu_ps(refSum + i), vnorm);
+				__m512 cmp_mu = _mm512_mul_ps(_mm512_loadu_ps(cmpSum + i), vnorm);
+
+				__m512 ref_mu_sq = _mm512_mul_ps(ref_mu, ref_mu);
+				__m512 cmp_mu_sq = _mm512_mul_ps(cmp_mu, cmp_mu);
+				__m512 mu_both = _mm512_mul_ps(ref_mu, cmp_mu);
+
+				__m512 ref_sigma_sqd = _mm512_sub_ps(_mm512_mul_ps(_mm512_loadu_ps(refSquaredSum + i), vnorm), ref_mu_sq);
+				__m512 cmp_sigma_sqd = _mm512_sub_ps(_mm512_mul_ps(_mm512_loadu_ps(cmpSquaredSum + i), vnorm), cmp_mu_sq);
+				__m512 sigma_both = _mm512_sub_ps(_mm512_mul_ps(_mm512_loadu_ps(bothSum + i), vnorm), mu_both);
+
+				__m512 denominator = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(ref_mu_sq, cmp_mu_sq), vc1), _mm512_add_ps(_mm512_add_ps(ref_sigma_sqd, cmp_sigma_sqd), vc2));
+				__m512 numerator = _mm512_mul_ps(_mm512_add_ps(_mm512_mul_ps(vtwo, mu_both), vc1), _mm512_add_ps(_mm512_mul_ps(vtwo, sigma_both), vc2));
+
+				__m512 ratio = _mm512_div_ps(numerator, denominator);
+
+				__m256 low = _mm512_castps512_ps256(ratio);
+				__m256 high = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(ratio), 1));
+
+				accumulator = _mm512_add_pd(accumulator, _mm512_cvtps_pd(low));
+				accumulator = _mm512_add_pd(accumulator, _mm512_cvtps_pd(high));
+			}
+
+			return _mm512_reduce_add_pd(accumulator) + ssimSumScalar(refSum + i, cmpSum + i, refSquaredSum + i, cmpSquaredSum + i, bothSum + i, count - i, norm);
+		}
+
+		struct CpuFeatures
+		{
+			bool sse41 = false;
+			bool avx2 = false;
+			bool avx512f = false;
+		};
+
+		CpuFeatures detectCpuFeatures()
+		{
+			CpuFeatures features;
+
+#if defined(_MSC_VER) && !defined(__clang__)
+			int info[4];
+
+			__cpuid(info, 0);
+			const int maxLeaf = info[0];
+
+			__cpuid(info, 1);
+			features.sse41 = (info[2] & (1 << 19)) != 0;
+
+			const bool osSavesAvx = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x06) == 0x06;
+			const bool osSavesAvx512 = osSavesAvx && (_xgetbv(0) & 0xE6) == 0xE6;
+
+			if (maxLeaf >= 7)
+			{
+				__cpuidex(info, 7, 0);
+				features.avx2 = osSavesAvx && (info[1] & (1 << 5)) != 0;
+				features.avx512f = osSavesAvx512 && (info[1] & (1 << 16)) != 0;
+			}
+#else
+			__builtin_cpu_init();
+
+			features.sse41 = __builtin_cpu_supports("sse4.1");
+			features.avx2 = __builtin_cpu_supports("avx2");
+			features.avx512f = __builtin_cpu_supports("avx512f");
+#endif
+
+			return features;
+		}
+
+#endif
+
+		const Kernels& Scalar()
+		{
+			static const Kernels scalar{ "scalar", convertToFloatScalar, productsScalar, ssimSumScalar };
+
+			return scalar;
+		}
+
+		const Kernels& selectKernels()
+		{
+#ifdef IOPT_X86_SIMD
+			static const Kernels sse41{ "sse4.1", convertToFloatSse41, productsSse41, ssimSumSse41 };
+			static const Kernels avx2{ "avx2", convertToFloatAvx2, productsAvx2, ssimSumAvx2 };
+			static const Kernels avx512{ "avx512f", convertToFloatAvx512, productsAvx512, ssimSumAvx512 };
+
+			const auto features = detectCpuFeatures();
+
+			if (features.avx512f)
+			{
+				return avx512;
+			}
+
+			if (features.avx2)
+			{
+				return avx2;
+			}
+
+			if (features.sse41)
+			{
+				return sse41;
+			}
+#endif
+
+			return Scalar();
+		}
+
+		const Kernels& Best()
+		{
+			static const Kernels& best = selectKernels();
+
+			return best;
+		}
+	}
+}
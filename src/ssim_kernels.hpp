@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace ImageSimilarity
+{
+	namespace kernels
+	{
+		// Per-pixel loops of the ssim computation, one implementation per instruction set
+		struct Kernels
+		{
+			const char* name;
+
+			void(*convertToFloat)(const uint8_t* source, float* destination, size_t count);
+
+			// ref * ref, cmp * cmp and ref * cmp
+			void(*products)(const float* ref, const float* cmp, float* refSquared, float* cmpSquared, float* both, size_t count);
+
+			// Combines the window sums into the ssim of each window and returns their total,
+			// norm is the reciprocal of the window area
+			double(*ssimSum)(const float* refSum, const float* cmpSum, const float* refSquaredSum, const float* cmpSquaredSum, const float* bothSum, size_t count, float norm);
+		};
+
+		const Kernels& Scalar();
+
+		// Best implementation supported by the running cpu, selected on first use
+		const Kernels& Best();
+	}
+}
@@ -0,0 +1,194 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+
+thread_local ThreadPool* ThreadPool::t_currentPool = nullptr;
+thread_local unsigned int ThreadPool::t_queueIndex = ThreadPool::s_sharedQueue;
+
+ThreadPool::ThreadPool(unsigned int threadCount) :
+	m_threadCount{ threadCount > 0 ? threadCount : std::max(1u, std::thread::hardware_concurrency()) }
+{
+	// The thread waiting on the results takes part in the work, see Wait
+	const auto workerCount = m_threadCount - 1;
+
+	m_queues.push_back(std::make_unique<WorkQueue>());
+
+	for (unsigned int worker = 0; worker < workerCount; worker++)
+	{
+		m_queues.push_back(std::make_unique<WorkQueue>());
+	}
+
+	for (unsigned int worker = 0; worker < workerCount; worker++)
+	{
+		m_workers.emplace_back([this, worker]() { workerLoop(worker + 1); });
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_wakeMutex);
+		m_stopping = true;
+	}
+
+	m_wakeCondition.notify_all();
+
+	for (auto& worker : m_workers)
+	{
+		worker.join();
+	}
+}
+
+void ThreadPool::push(task_t task)
+{
+	const auto queueIndex = (t_currentPool == this) ? t_queueIndex : s_sharedQueue;
+
+	{
+		std::lock_guard<std::mutex> lock(m_queues[queueIndex]->mutex);
+		m_queues[queueIndex]->tasks.push_back(std::move(task));
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_wakeMutex);
+		m_pendingTasks++;
+
+		if (m_waiters > 0)
+		{
+			m_waitCondition.notify_all();
+		}
+	}
+
+	m_wakeCondition.notify_one();
+}
+
+bool ThreadPool::tryPopLocal(unsigned int queueIndex, task_t& task)
+{
+	auto& queue = *m_queues[queueIndex];
+
+	std::lock_guard<std::mutex> lock(queue.mutex);
+
+	if (queue.tasks.empty())
+	{
+		return false;
+	}
+
+	// Workers run their own most recent task first, the shared queue keeps submission order
+	if (queueIndex == s_sharedQueue)
+	{
+		task = std::move(queue.tasks.front());
+		queue.tasks.pop_front();
+	}
+	else
+	{
+		task = std::move(queue.tasks.back());
+		queue.tasks.pop_back();
+	}
+
+	m_pendingTasks--;
+
+	return true;
+}
+
+bool ThreadPool::trySteal(unsigned int queueIndex, task_t& task)
+{
+	const auto queueCount = static_cast<unsigned int>(m_queues.size());
+
+	for (unsigned int offset = 0; offset < queueCount; offset++)
+	{
+		// Start from the shared queue, then the neighbours
+		const auto victim = (offset == 0) ? s_sharedQueue : (queueIndex + offset) % queueCount;
+
+		if (victim == queueIndex || (offset > 0 && victim == s_sharedQueue))
+		{
+			continue;
+		}
+
+		auto& queue = *m_queues[victim];
+
+		std::lock_guard<std::mutex> lock(queue.mutex);
+
+		if (!queue.tasks.empty())
+		{
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+
+			m_pendingTasks--;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool ThreadPool::runPendingTask()
+{
+	const auto queueIndex = (t_currentPool == this) ? t_queueIndex : s_sharedQueue;
+
+	task_t task;
+
+	if (tryPopLocal(queueIndex, task) || trySteal(queueIndex, task))
+	{
+		task();
+		notifyWaiters();
+
+		return true;
+	}
+
+	return false;
+}
+
+void ThreadPool::workerLoop(unsigned int queueIndex)
+{
+	t_currentPool = this;
+	t_queueIndex = queueIndex;
+
+	while (true)
+	{
+		task_t task;
+
+		if (tryPopLocal(queueIndex, task) || trySteal(queueIndex, task))
+		{
+			task();
+			notifyWaiters();
+
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_wakeMutex);
+
+		m_wakeCondition.wait(lock, [this]() { return m_stopping || m_pendingTasks > 0; });
+
+		if (m_stopping && m_pendingTasks == 0)
+		{
+			return;
+		}
+	}
+}
+
+// Taking the lock orders the notification after the change the waiters check for, which is made before
+void ThreadPool::notifyWaiters()
+{
+	std::lock_guard<std::mutex> lock(m_wakeMutex);
+
+	if (m_waiters > 0)
+	{
+		m_waitCondition.notify_all();
+	}
+}
+
+void TaskGroup::Wait()
+{
+	m_threadPool.helpUntil([this]() { return m_pendingTasks == 0; });
+}
+
+// The group can be gone once the count is down, as soon as Wait sees it
+void TaskGroup::Leave()
+{
+	auto& threadPool = m_threadPool;
+
+	m_pendingTasks--;
+
+	threadPool.notifyWaiters();
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+
+// Work-stealing pool: every worker owns a deque it pushes to and pops from at the back,
+// idle workers steal from the front of the other deques. Tasks submitted from threads
+// outside the pool go to a shared FIFO queue, so they are started in submission order:
+// the largest images first. Every queue has its own mutex, and each push and finished task
+// also takes the one idle threads sleep on. That is fine for image sized tasks: many short ones
+// should be submitted from a task, where they go to the worker's own deque.
+class ThreadPool
+{
+public:
+	// threadCount is the total parallelism including the thread that waits on the results,
+	// 0 means one per hardware thread
+	explicit ThreadPool(unsigned int threadCount = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned int GetThreadCount() const { return m_threadCount; }
+
+	template <typename Function>
+	auto Submit(Function&& function) -> std::future<std::invoke_result_t<std::decay_t<Function>>>
+	{
+		using result_t = std::invoke_result_t<std::decay_t<Function>>;
+
+		auto task = std::make_shared<std::packaged_task<result_t()>>(std::forward<Function>(function));
+		auto future = task->get_future();
+
+		push([task]() { (*task)(); });
+
+		return future;
+	}
+
+	// Runs pending tasks on the calling thread until the future is ready, so waiting
+	// from inside a task never deadlocks the pool
+	template <typename T>
+	T Wait(std::future<T>& future)
+	{
+		helpUntil([&future]() { return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready; });
+
+		return future.get();
+	}
+
+private:
+	friend class TaskGroup;
+
+	using task_t = std::function<void()>;
+
+	struct WorkQueue
+	{
+		std::mutex mutex;
+		std::deque<task_t> tasks;
+	};
+
+	void push(task_t task);
+	bool tryPopLocal(unsigned int queueIndex, task_t& task);
+	bool trySteal(unsigned int queueIndex, task_t& task);
+	bool runPendingTask();
+	void workerLoop(unsigned int queueIndex);
+	void notifyWaiters();
+
+	// Runs pending tasks on the calling thread until done() holds, sleeping while there are none.
+	// Whatever makes done() hold has to call notifyWaiters afterwards, finished tasks do
+	template <typename Predicate>
+	void helpUntil(Predicate done)
+	{
+		while (!done())
+		{
+			if (runPendingTask())
+			{
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(m_wakeMutex);
+
+			m_waiters++;
+			m_waitCondition.wait(lock, [this, &done]() { return m_pendingTasks > 0 || done(); });
+			m_waiters--;
+		}
+	}
+
+	static constexpr unsigned int s_sharedQueue = 0;
+
+	static thread_local ThreadPool* t_currentPool;
+	static thread_local unsigned int t_queueIndex;
+
+	const unsigned int m_threadCount;
+
+	std::vector<std::unique_ptr<WorkQueue>> m_queues;
+	std::vector<std::thread> m_workers;
+
+	std::atomic<size_t> m_pendingTasks{ 0 };
+	std::mutex m_wakeMutex;
+	std::condition_variable m_wakeCondition;
+	bool m_stopping = false;
+
+	// Threads in helpUntil, guarded by m_wakeMutex
+	std::condition_variable m_waitCondition;
+	size_t m_waiters = 0;
+};
+
+// Tasks that may add more tasks to their own group while running, for work whose size is only known
+// as it goes. Exceptions thrown by a task are lost, tasks handle their own errors
+class TaskGroup
+{
+public:
+	explicit TaskGroup(ThreadPool& threadPool) : m_threadPool{ threadPool } {}
+
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+
+	template <typename Function>
+	void Run(Function&& function)
+	{
+		m_pendingTasks++;
+
+		m_threadPool.Submit([this, function = std::forward<Function>(function)]() mutable {
+			Completion completion{ m_pendingTasks };
+
+			function();
+		});
+	}
+
+	// Like ThreadPool::Wait, runs pending tasks on the calling thread until the whole group is done
+	void Wait();
+
+	// For threads outside the pool that add tasks to the group: Wait doesn't return between Enter and Leave
+	void Enter() { m_pendingTasks++; }
+	void Leave();
+
+private:
+	struct Completion
+	{
+		std::atomic<size_t>& pendingTasks;
+
+		~Completion() { pendingTasks--; }
+	};
+
+	ThreadPool& m_threadPool;
+	std::atomic<size_t> m_pendingTasks{ 0 };
+};
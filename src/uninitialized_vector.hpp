@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+// Default-initializes the elements a vector adds, so resizing a vector of bytes doesn't clear memory
+// that is overwritten right after, by a read for instance
+template <typename T>
+class DefaultInitAllocator : public std::allocator<T>
+{
+public:
+	template <typename U>
+	struct rebind
+	{
+		using other = DefaultInitAllocator<U>;
+	};
+
+	DefaultInitAllocator() = default;
+
+	template <typename U>
+	DefaultInitAllocator(const DefaultInitAllocator<U>&) noexcept {}
+
+	template <typename U>
+	void construct(U* pointer) noexcept(std::is_nothrow_default_constructible<U>::value)
+	{
+		::new (static_cast<void*>(pointer)) U;
+	}
+
+	template <typename U, typename... Args>
+	void construct(U* pointer, Args&&... args)
+	{
+		::new (static_cast<void*>(pointer)) U(std::forward<Args>(args)...);
+	}
+};
+
+// Bytes whose content is undefined after growing
+using UninitializedBytes = std::vector<uint8_t, DefaultInitAllocator<uint8_t>>;
@@ -0,0 +1,100 @@
+#include "xxhash.hpp"
+
+#include <cstring>
+
+
+namespace xxhash {
+
+	namespace {
+		constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+		constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+		constexpr uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+		constexpr uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+		constexpr uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+		uint64_t rotateLeft(uint64_t value, int bits) {
+			return (value << bits) | (value >> (64 - bits));
+		}
+
+		// The format is little endian, memcpy keeps unaligned reads legal
+		uint64_t read64(const uint8_t* data) {
+			uint64_t value;
+			std::memcpy(&value, data, sizeof(value));
+			return value;
+		}
+
+		uint32_t read32(const uint8_t* data) {
+			uint32_t value;
+			std::memcpy(&value, data, sizeof(value));
+			return value;
+		}
+
+		uint64_t round(uint64_t accumulator, uint64_t input) {
+			accumulator += input * PRIME2;
+			accumulator = rotateLeft(accumulator, 31);
+			return accumulator * PRIME1;
+		}
+
+		uint64_t mergeRound(uint64_t accumulator, uint64_t value) {
+			accumulator ^= round(0, value);
+			return accumulator * PRIME1 + PRIME4;
+		}
+	}
+
+	uint64_t hash64(const void* data, size_t size, uint64_t seed) {
+		const uint8_t* input = static_cast<const uint8_t*>(data);
+		const uint8_t* const end = input + size;
+
+		uint64_t hash;
+
+		if (size >= 32) {
+			// Four independent lanes over 32 byte stripes
+			uint64_t lanes[4] = { seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1 };
+
+			const uint8_t* const limit = end - 32;
+
+			do {
+				for (int lane = 0; lane < 4; lane++) {
+					lanes[lane] = round(lanes[lane], read64(input + lane * 8));
+				}
+
+				input += 32;
+			} while (input <= limit);
+
+			hash = rotateLeft(lanes[0], 1) + rotateLeft(lanes[1], 7) + rotateLeft(lanes[2], 12) + rotateLeft(lanes[3], 18);
+
+			for (auto lane : lanes) {
+				hash = mergeRound(hash, lane);
+			}
+		}
+		else {
+			hash = seed + PRIME5;
+		}
+
+		hash += static_cast<uint64_t>(size);
+
+		for (; input + 8 <= end; input += 8) {
+			hash ^= round(0, read64(input));
+			hash = rotateLeft(hash, 27) * PRIME1 + PRIME4;
+		}
+
+		if (input + 4 <= end) {
+			hash ^= static_cast<uint64_t>(read32(input)) * PRIME1;
+			hash = rotateLeft(hash, 23) * PRIME2 + PRIME3;
+			input += 4;
+		}
+
+		for (; input < end; input++) {
+			hash ^= (*input) * PRIME5;
+			hash = rotateLeft(hash, 11) * PRIME1;
+		}
+
+		hash ^= hash >> 33;
+		hash *= PRIME2;
+		hash ^= hash >> 29;
+		hash *= PRIME3;
+		hash ^= hash >> 32;
+
+		return hash;
+	}
+}
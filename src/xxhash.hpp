@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace xxhash {
+	// XXH64 of the data, same values as the reference implementation
+	uint64_t hash64(const void* data, size_t size, uint64_t seed = 0);
+};
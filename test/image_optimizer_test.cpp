@@ -0,0 +1,180 @@
+#include <catch2/catch.hpp>
+
+#include <iopt/image_optimizer.hpp>
+
+#include "jpeg.hpp"
+#include "test_images.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+	void writeJpeg(const fs::path& path, unsigned int quality)
+	{
+		fs::create_directories(path.parent_path());
+
+		jpeg::Buffer compressed;
+		jpeg::memory_encode_grayscale(syntheticImage(160, 120), quality, compressed, jpeg::thread_codec());
+
+		jpeg::save_file(path.string(), compressed.Data(), compressed.Size());
+	}
+
+	// Relative to the folder, sorted
+	std::vector<std::string> listFiles(const fs::path& folder)
+	{
+		std::vector<std::string> files;
+
+		for (auto& entry : fs::recursive_directory_iterator(folder))
+		{
+			if (entry.is_regular_file())
+			{
+				files.push_back(entry.path().lexically_relative(folder).generic_string());
+			}
+		}
+
+		std::sort(files.begin(), files.end());
+
+		return files;
+	}
+
+	struct Tree
+	{
+		fs::path input;
+		fs::path output;
+
+		Tree(const std::string& name, const fs::path& outputFolder) : input{ fs::temp_directory_path() / name }, output{ outputFolder }
+		{
+			fs::remove_all(input);
+			fs::remove_all(output);
+
+			writeJpeg(input / "top.jpg", 95);
+			writeJpeg(input / "a" / "b" / "deep.jpg", 95);
+			fs::create_directories(input / "a" / "empty");
+		}
+
+		~Tree()
+		{
+			fs::remove_all(input);
+			fs::remove_all(output);
+		}
+	};
+
+	const ImageSimilarity::Similarity s_similarity{ 0.999f };
+}
+
+TEST_CASE("Outputs can't go to another folder in place", "[optimizer]") {
+	ImageOptimizer optimizer{ 1 };
+
+	optimizer.SetInPlace(true);
+
+	REQUIRE_THROWS_AS(optimizer.SetOutputFolder("outputs"), std::invalid_argument);
+
+	optimizer.SetInPlace(false);
+	optimizer.SetOutputFolder("outputs");
+
+	REQUIRE_THROWS_AS(optimizer.SetInPlace(true), std::invalid_argument);
+
+	optimizer.SetOutputFolder("");
+	optimizer.SetInPlace(true);
+}
+
+TEST_CASE("Outputs mirror the input tree in the output folder", "[optimizer]") {
+	const Tree tree{ "iopt_mirror_input", fs::temp_directory_path() / "iopt_mirror_output" };
+
+	ImageOptimizer optimizer{ 2 };
+	optimizer.SetOutputFolder(tree.output.string());
+
+	optimizer.OptimizeFolderRecursive(tree.input.string(), s_similarity);
+
+	REQUIRE(listFiles(tree.output) == std::vector<std::string>{ "a/b/deep_compressed0.jpg", "top_compressed0.jpg" });
+	REQUIRE(listFiles(tree.input) == std::vector<std::string>{ "a/b/deep.jpg", "top.jpg" });
+
+	// Only folders with images are created
+	REQUIRE_FALSE(fs::exists(tree.output / "a" / "empty"));
+
+	// The folder given is the root of the mirror
+	optimizer.OptimizeFolder((tree.input / "a" / "b").string(), s_similarity);
+
+	REQUIRE(fs::exists(tree.output / "deep_compressed0.jpg"));
+}
+
+TEST_CASE("An output folder inside the input tree isn't walked", "[optimizer]") {
+	const auto input = fs::temp_directory_path() / "iopt_nested_output";
+	const Tree tree{ "iopt_nested_output", input / "outputs" };
+
+	ImageOptimizer optimizer{ 2 };
+	optimizer.SetOutputFolder(tree.output.string());
+
+	// The outputs of the first run would be optimized again by the second one
+	optimizer.OptimizeFolderRecursive(tree.input.string(), s_similarity);
+	optimizer.OptimizeFolderRecursive(tree.input.string(), s_similarity);
+
+	REQUIRE(listFiles(tree.output) == std::vector<std::string>{ "a/b/deep_compressed0.jpg", "a/b/deep_compressed1.jpg", "top_compressed0.jpg", "top_compressed1.jpg" });
+}
+
+TEST_CASE("A single image is written directly in the output folder", "[optimizer]") {
+	const Tree tree{ "iopt_single_input", fs::temp_directory_path() / "iopt_single_output" };
+
+	ImageOptimizer optimizer{ 2 };
+	optimizer.SetOutputFolder(tree.output.string());
+
+	const auto result = optimizer.OptimizeImage((tree.input / "a" / "b" / "deep.jpg").string(), s_similarity);
+
+	REQUIRE(result.IsCompressed());
+	REQUIRE(listFiles(tree.output) == std::vector<std::string>{ "deep_compressed0.jpg" });
+	REQUIRE(fs::file_size(tree.output / "deep_compressed0.jpg") == result.GetCompressedSize());
+}
+
+TEST_CASE("Known results are skipped only when their output is there", "[optimizer]") {
+	const Tree tree{ "iopt_cached_input", fs::temp_directory_path() / "iopt_cached_output" };
+	const auto otherOutput = fs::temp_directory_path() / "iopt_cached_other_output";
+	const auto cachePath = fs::temp_directory_path() / "iopt_cached_results";
+
+	fs::remove_all(otherOutput);
+	fs::remove(cachePath);
+
+	const std::vector<std::string> outputs{ "a/b/deep_compressed0.jpg", "top_compressed0.jpg" };
+
+	ImageOptimizer optimizer{ 2 };
+	optimizer.SetResultCache(cachePath.string());
+	optimizer.SetOutputFolder(tree.output.string());
+
+	optimizer.OptimizeFolderRecursive(tree.input.string(), s_similarity);
+	optimizer.OptimizeFolderRecursive(tree.input.string(), s_similarity);
+
+	// The second run found the outputs of the first one
+	REQUIRE(listFiles(tree.output) == outputs);
+
+	optimizer.SetOutputFolder(otherOutput.string());
+	optimizer.OptimizeFolderRecursive(tree.input.string(), s_similarity);
+
+	REQUIRE(listFiles(otherOutput) == outputs);
+
+	optimizer.SetOutputFolder("");
+	optimizer.SetInPlace(true);
+
+	const auto originalSize = fs::file_size(tree.input / "top.jpg");
+
+	optimizer.OptimizeFolderRecursive(tree.input.string(), s_similarity);
+
+	const auto replacedSize = fs::file_size(tree.input / "top.jpg");
+	const auto replacedTime = fs::last_write_time(tree.input / "top.jpg");
+
+	REQUIRE(replacedSize < originalSize);
+
+	// Already at the target
+	optimizer.OptimizeFolderRecursive(tree.input.string(), s_similarity);
+
+	REQUIRE(fs::file_size(tree.input / "top.jpg") == replacedSize);
+	REQUIRE(fs::last_write_time(tree.input / "top.jpg") == replacedTime);
+	REQUIRE(listFiles(tree.input) == std::vector<std::string>{ "a/b/deep.jpg", "top.jpg" });
+
+	fs::remove_all(otherOutput);
+	fs::remove(cachePath);
+}
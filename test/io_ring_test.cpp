@@ -0,0 +1,80 @@
+#include <catch2/catch.hpp>
+
+#include "io_ring.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+TEST_CASE("Io ring writes and reads back whole files", "[io]") {
+	auto ring = IoRing::Create(4);
+
+	if (!ring)
+	{
+		WARN("io_uring isn't available, folders are read with blocking calls");
+		return;
+	}
+
+	// More files than transfers in flight, of sizes that aren't multiples of a page
+	std::vector<std::vector<uint8_t>> contents;
+
+	for (size_t i = 0; i < 10; i++)
+	{
+		std::vector<uint8_t> content(1000 + i * 40000);
+
+		for (size_t j = 0; j < content.size(); j++)
+		{
+			content[j] = static_cast<uint8_t>(j * 7 + i);
+		}
+
+		contents.push_back(std::move(content));
+	}
+
+	const auto folder = fs::temp_directory_path() / "iopt_io_ring_test";
+	fs::remove_all(folder);
+	fs::create_directory(folder);
+
+	std::vector<IoRing::FileWrite> writes;
+	std::vector<IoRing::FileRead> reads;
+
+	for (size_t i = 0; i < contents.size(); i++)
+	{
+		const auto path = (folder / std::to_string(i)).string();
+
+		writes.push_back({ open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666), contents[i].data(), contents[i].size() });
+		reads.push_back({ path, {} });
+	}
+
+	reads.push_back({ (folder / "missing").string(), {} });
+	reads.push_back({ folder.string(), {} });
+
+	ring->WriteFiles(writes);
+
+	for (const auto& write : writes)
+	{
+		REQUIRE(write.error == 0);
+		REQUIRE(close(write.descriptor) == 0);
+	}
+
+	ring->ReadFiles(reads);
+
+	for (size_t i = 0; i < contents.size(); i++)
+	{
+		REQUIRE(reads[i].error == 0);
+		REQUIRE(std::equal(reads[i].data.begin(), reads[i].data.end(), contents[i].begin(), contents[i].end()));
+	}
+
+	REQUIRE(reads[contents.size()].error == ENOENT);
+	REQUIRE(reads[contents.size() + 1].error == ESPIPE);
+
+	fs::remove_all(folder);
+}
+#endif
@@ -0,0 +1,346 @@
+#include <catch2/catch.hpp>
+
+#include <iopt/image.hpp>
+#include <iopt/image_similarity.hpp>
+
+#include "jpeg.hpp"
+#include "test_images.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <new>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+// glibc lets the executable replace malloc, which also sees what tjAlloc and libjpeg allocate.
+// Sanitizers replace it themselves
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer) || __has_feature(memory_sanitizer)
+#define SANITIZED_BUILD
+#endif
+#endif
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__) && !defined(SANITIZED_BUILD)
+#define COUNT_MALLOC
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* memory, size_t size);
+extern "C" void __libc_free(void* memory);
+#endif
+
+namespace {
+	std::atomic<size_t> g_allocations{ 0 };
+
+	// Of the calling thread, so pools left by other tests don't count
+	struct HeapAllocations
+	{
+		size_t count;
+		size_t largest;
+	};
+
+	thread_local HeapAllocations t_heapAllocations{ 0, 0 };
+
+#ifdef COUNT_MALLOC
+	void countHeapAllocation(size_t size)
+	{
+		t_heapAllocations.count++;
+		t_heapAllocations.largest = std::max(t_heapAllocations.largest, size);
+	}
+#endif
+
+	float probe(const Image& image, unsigned int quality, jpeg::Codec& codec, jpeg::Buffer& compressed, Image& decompressed)
+	{
+		jpeg::memory_encode_grayscale(image, quality, compressed, codec);
+		jpeg::memory_decode_grayscale(compressed.Data(), compressed.Size(), decompressed, codec);
+
+		return ImageSimilarity::ComputeSsim(image, decompressed).GetValue();
+	}
+}
+
+// Counts every allocation of the test executable
+void* operator new(std::size_t size)
+{
+	g_allocations++;
+
+	if (void* memory = std::malloc(size ? size : 1))
+	{
+		return memory;
+	}
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept
+{
+	std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+	std::free(memory);
+}
+
+#ifdef COUNT_MALLOC
+extern "C" void* malloc(size_t size)
+{
+	countHeapAllocation(size);
+
+	return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+	countHeapAllocation(count * size);
+
+	return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* memory, size_t size)
+{
+	countHeapAllocation(size);
+
+	return __libc_realloc(memory, size);
+}
+
+extern "C" void free(void* memory)
+{
+	__libc_free(memory);
+}
+#endif
+
+TEST_CASE("Grayscale round trip keeps the size", "[jpeg]") {
+	auto image = syntheticImage(321, 123);
+
+	auto& codec = jpeg::thread_codec();
+	jpeg::Buffer compressed;
+	Image decompressed;
+
+	jpeg::memory_encode_grayscale(image, 90, compressed, codec);
+
+	REQUIRE(compressed.Size() > 0);
+	REQUIRE(compressed.Size() <= compressed.Capacity());
+
+	jpeg::memory_decode_grayscale(compressed.Data(), compressed.Size(), decompressed, codec);
+
+	REQUIRE(decompressed.width == image.width);
+	REQUIRE(decompressed.height == image.height);
+	REQUIRE(decompressed.data.size() == image.data.size());
+}
+
+TEST_CASE("Planar round trip keeps size and subsampling", "[jpeg]") {
+	auto image = syntheticImage(333, 125);
+
+	auto& codec = jpeg::thread_codec();
+	jpeg::Buffer compressed;
+	jpeg::PlanarImage planar;
+	Image luma;
+	Image grayscale;
+
+	jpeg::memory_encode_grayscale(image, 85, compressed, codec);
+	jpeg::memory_decode_planar(compressed.Data(), compressed.Size(), planar, codec);
+
+	REQUIRE(planar.width == image.width);
+	REQUIRE(planar.height == image.height);
+	REQUIRE(planar.Components() == 1);
+
+	jpeg::luma_plane(planar, luma);
+	jpeg::memory_decode_grayscale(compressed.Data(), compressed.Size(), grayscale, codec);
+
+	REQUIRE(luma.data == grayscale.data);
+
+	jpeg::PlanarImage reencoded;
+
+	jpeg::memory_encode_planar(planar, 85, compressed, codec);
+	jpeg::memory_decode_planar(compressed.Data(), compressed.Size(), reencoded, codec);
+
+	REQUIRE(reencoded.width == planar.width);
+	REQUIRE(reencoded.height == planar.height);
+	REQUIRE(reencoded.subsampling == planar.subsampling);
+}
+
+TEST_CASE("CMYK images keep their colors", "[jpeg]") {
+	const int width = 96;
+	const int height = 64;
+
+	// No ink on the left half, black ink only on the right half
+	jpeg::PlanarImage cmyk;
+	cmyk.width = width;
+	cmyk.height = height;
+	cmyk.subsampling = 0; // 4:4:4
+	cmyk.pixelFormat = jpeg::PixelFormat::Cmyk;
+	cmyk.pixels = { width, height, std::vector<unsigned char>(static_cast<size_t>(width) * height * 4, 255) };
+
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = width / 2; x < width; x++)
+		{
+			cmyk.pixels.data[(static_cast<size_t>(y) * width + x) * 4 + 3] = 0;
+		}
+	}
+
+	auto& codec = jpeg::thread_codec();
+	jpeg::Buffer compressed;
+	jpeg::PlanarImage decoded;
+
+	// Encoded as YCCK, which can't be decoded to planes
+	jpeg::memory_encode_planar(cmyk, 95, compressed, codec);
+	jpeg::memory_decode_planar(compressed.Data(), compressed.Size(), decoded, codec);
+
+	REQUIRE(decoded.pixelFormat == jpeg::PixelFormat::Cmyk);
+	REQUIRE(decoded.pixels.width == width);
+	REQUIRE(decoded.pixels.height == height);
+	REQUIRE(decoded.pixels.data.size() == cmyk.pixels.data.size());
+
+	int maximumDifference = 0;
+
+	for (size_t i = 0; i < cmyk.pixels.data.size(); i++)
+	{
+		maximumDifference = std::max(maximumDifference, std::abs(decoded.pixels.data[i] - cmyk.pixels.data[i]));
+	}
+
+	REQUIRE(maximumDifference < 16);
+
+	Image luma;
+	jpeg::luma_plane(decoded, luma);
+
+	REQUIRE(luma.width == width);
+	REQUIRE(luma.height == height);
+	REQUIRE(luma.data[static_cast<size_t>(height / 2) * width + 4] > 240);
+	REQUIRE(luma.data[static_cast<size_t>(height / 2) * width + width - 4] < 16);
+
+	jpeg::memory_encode_planar(decoded, 80, compressed, codec);
+
+	jpeg::PlanarImage reencoded;
+	jpeg::memory_decode_planar(compressed.Data(), compressed.Size(), reencoded, codec);
+
+	REQUIRE(reencoded.pixelFormat == jpeg::PixelFormat::Cmyk);
+}
+
+TEST_CASE("Quality is estimated from the quantization tables", "[jpeg]") {
+	auto image = syntheticImage(64, 64);
+
+	auto& codec = jpeg::thread_codec();
+	jpeg::Buffer compressed;
+
+	for (unsigned int quality : { 10u, 50u, 75u, 90u, 100u })
+	{
+		jpeg::memory_encode_grayscale(image, quality, compressed, codec);
+
+		REQUIRE(jpeg::estimate_quality(compressed.Data(), compressed.Size()) == quality);
+	}
+
+	const uint8_t noTables[] = { 0xFF, 0xD8, 0xFF, 0xD9 };
+
+	REQUIRE(jpeg::estimate_quality(noTables, sizeof(noTables)) == 0);
+}
+
+TEST_CASE("Files are loaded whole or not at all", "[jpeg]") {
+	const auto path = (std::filesystem::temp_directory_path() / "iopt_load_file_test").string();
+	std::filesystem::remove(path);
+
+	REQUIRE_THROWS_AS(jpeg::load_file(path), std::runtime_error);
+
+	auto& codec = jpeg::thread_codec();
+	jpeg::Buffer compressed;
+	jpeg::memory_encode_grayscale(syntheticImage(64, 64), 90, compressed, codec);
+
+	jpeg::save_file(path, compressed.Data(), compressed.Size());
+
+	auto file = jpeg::load_file(path);
+
+	REQUIRE(file.Size() == compressed.Size());
+	REQUIRE(std::memcmp(file.Data(), compressed.Data(), compressed.Size()) == 0);
+
+	std::filesystem::remove(path);
+
+#ifndef _WIN32
+	// A pipe can't be mapped, it is read until the writer closes it
+	REQUIRE(mkfifo(path.c_str(), 0600) == 0);
+
+	std::thread writer([&]() { jpeg::save_file(path, compressed.Data(), compressed.Size()); });
+
+	auto piped = jpeg::load_file(path);
+	writer.join();
+
+	REQUIRE(piped.Size() == compressed.Size());
+	REQUIRE(std::memcmp(piped.Data(), compressed.Data(), compressed.Size()) == 0);
+
+	std::filesystem::remove(path);
+#endif
+}
+
+TEST_CASE("Quality probes don't allocate after the first one", "[jpeg]") {
+	auto image = syntheticImage(1024, 768);
+
+	auto& codec = jpeg::thread_codec();
+	jpeg::Buffer compressed;
+	Image decompressed;
+
+	probe(image, 75, codec, compressed, decompressed);
+
+	const auto before = g_allocations.load();
+
+	// The tjAlloc buffer and the decoded image stay where they are
+	const auto* compressedData = compressed.Data();
+	const auto compressedCapacity = compressed.Capacity();
+	const auto* decompressedData = decompressed.data.data();
+
+	t_heapAllocations = { 0, 0 };
+
+	for (unsigned int quality = 50; quality <= 100; quality += 5)
+	{
+		probe(image, quality, codec, compressed, decompressed);
+	}
+
+	REQUIRE(g_allocations.load() == before);
+
+	REQUIRE(compressed.Data() == compressedData);
+	REQUIRE(compressed.Capacity() == compressedCapacity);
+	REQUIRE(decompressed.data.data() == decompressedData);
+
+#ifdef COUNT_MALLOC
+	// libjpeg still sets up its state for every image from its pools and TurboJPEG allocates the row pointers,
+	// nothing of the size of the buffers reused here
+	INFO("Heap allocations " << t_heapAllocations.count << ", largest " << t_heapAllocations.largest);
+
+	REQUIRE(t_heapAllocations.largest < decompressed.data.size() / 16);
+#endif
+}
+
+TEST_CASE("Quality probe benchmark", "[.][benchmark]") {
+	auto image = syntheticImage(4000, 3000);
+
+	auto& codec = jpeg::thread_codec();
+	jpeg::Buffer compressed;
+	Image decompressed;
+
+	const auto before = g_allocations.load();
+
+	t_heapAllocations = { 0, 0 };
+	probe(image, 75, codec, compressed, decompressed);
+	const auto firstProbe = g_allocations.load() - before;
+	[[maybe_unused]] const auto firstHeap = t_heapAllocations;
+
+	t_heapAllocations = { 0, 0 };
+	probe(image, 80, codec, compressed, decompressed);
+	const auto nextProbe = g_allocations.load() - before - firstProbe;
+	[[maybe_unused]] const auto nextHeap = t_heapAllocations;
+
+	WARN("Allocations: first probe " << firstProbe << ", following probes " << nextProbe);
+
+#ifdef COUNT_MALLOC
+	WARN("Heap allocations: first probe " << firstHeap.count << " (largest " << firstHeap.largest << " bytes), following probes "
+		<< nextHeap.count << " (largest " << nextHeap.largest << " bytes)");
+#endif
+
+	BENCHMARK("encode + decode + ssim, 12 MP") {
+		return probe(image, 85, codec, compressed, decompressed);
+	};
+}
@@ -0,0 +1,278 @@
+#include <catch2/catch.hpp>
+
+#include "output_names.hpp"
+#include "output_writer.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace
+{
+	std::vector<uint8_t> readFile(const fs::path& path)
+	{
+		std::ifstream file(path, std::ios::binary);
+
+		return { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+	}
+
+	size_t countFiles(const fs::path& folder)
+	{
+		return static_cast<size_t>(std::distance(fs::directory_iterator(folder), fs::directory_iterator()));
+	}
+}
+
+TEST_CASE("Outputs only appear once complete and never replace a file", "[output]") {
+	const auto folder = fs::temp_directory_path() / "iopt_output_writer_test";
+	fs::remove_all(folder);
+	fs::create_directory(folder);
+
+	const std::vector<uint8_t> content(100000, 42);
+	const auto imagePath = (folder / "image.jpg").string();
+	const auto outputPath = (folder / "image_compressed0.jpg").string();
+
+	OutputWriter writer;
+
+	{
+		auto file = writer.Create(imagePath);
+		OutputWriter::WriteAll(file, content.data(), content.size());
+
+		// Abandoned before the commit
+	}
+
+	REQUIRE(countFiles(folder) == 0);
+
+	auto file = writer.Create(imagePath);
+	OutputWriter::WriteAll(file, content.data(), content.size());
+
+	REQUIRE(writer.Commit(file, outputPath));
+	REQUIRE(readFile(outputPath) == content);
+	REQUIRE(countFiles(folder) == 1);
+
+	const std::vector<uint8_t> other(10, 1);
+
+	auto otherFile = writer.Create(imagePath);
+	OutputWriter::WriteAll(otherFile, other.data(), other.size());
+
+	// Still pending, it can go under another name
+	REQUIRE_FALSE(writer.Commit(otherFile, outputPath));
+	REQUIRE(readFile(outputPath) == content);
+
+	const auto otherPath = (folder / "image_compressed1.jpg").string();
+
+	REQUIRE(writer.Commit(otherFile, otherPath));
+	REQUIRE(readFile(otherPath) == other);
+	REQUIRE(countFiles(folder) == 2);
+
+	writer.Sync();
+
+	fs::remove_all(folder);
+}
+
+TEST_CASE("Originals are cloned, copied or linked as their output", "[output]") {
+	const auto folder = fs::temp_directory_path() / "iopt_output_writer_original_test";
+	fs::remove_all(folder);
+	fs::create_directory(folder);
+
+	const std::vector<uint8_t> content(3000000, 7);
+	const auto imagePath = (folder / "image.jpg").string();
+
+	OutputWriter writer;
+
+	auto original = writer.Create(imagePath);
+	OutputWriter::WriteAll(original, content.data(), content.size());
+	REQUIRE(writer.Commit(original, imagePath));
+
+	const auto copyPath = (folder / "image_compressed0.jpg").string();
+	const auto linkPath = (folder / "image_compressed1.jpg").string();
+
+	auto copy = writer.CloneOriginal(imagePath, imagePath);
+	REQUIRE(writer.Commit(copy, copyPath));
+	REQUIRE(writer.LinkOriginal(imagePath, linkPath));
+
+	REQUIRE(readFile(copyPath) == content);
+	REQUIRE(readFile(linkPath) == content);
+	REQUIRE_FALSE(fs::equivalent(imagePath, copyPath));
+	REQUIRE(fs::equivalent(imagePath, linkPath));
+
+	REQUIRE_FALSE(writer.LinkOriginal(imagePath, copyPath));
+	REQUIRE_THROWS_AS(writer.LinkOriginal((folder / "missing.jpg").string(), (folder / "missing_compressed0.jpg").string()), std::runtime_error);
+
+	fs::remove_all(folder);
+}
+
+TEST_CASE("Output names follow the highest counter of their folder", "[output]") {
+	const auto folder = fs::temp_directory_path() / "iopt_output_names_test";
+	fs::remove_all(folder);
+	fs::create_directory(folder);
+
+	std::ofstream(folder / "image_compressed0.jpg");
+	std::ofstream(folder / "image_compressed5.jpg");
+	std::ofstream(folder / "image_compressed7.png");
+	std::ofstream(folder / "image_compressedx.jpg");
+
+	OutputNames names("_compressed");
+
+	const auto imagePath = (folder / "image.jpg").string();
+
+	REQUIRE(names.HasOutput(imagePath));
+	REQUIRE_FALSE(names.HasOutput((folder / "other.jpg").string()));
+	REQUIRE(names.IsOutput((folder / "image_compressed5.jpg").string()));
+	REQUIRE_FALSE(names.IsOutput((folder / "image_compressedx.jpg").string()));
+
+	REQUIRE(names.Next(imagePath) == (folder / "image_compressed6.jpg").string());
+	REQUIRE(names.Next(imagePath) == (folder / "image_compressed7.jpg").string());
+	REQUIRE(names.Next((folder / "other.jpg").string()) == (folder / "other_compressed0.jpg").string());
+
+	std::ofstream(folder / "other_compressed3.jpg");
+
+	// Only listed again once cleared
+	REQUIRE(names.Next((folder / "other.jpg").string()) == (folder / "other_compressed1.jpg").string());
+
+	names.Clear();
+
+	REQUIRE(names.Next((folder / "other.jpg").string()) == (folder / "other_compressed4.jpg").string());
+
+	fs::remove_all(folder);
+}
+
+TEST_CASE("Images are only replaced by a smaller file with the same attributes", "[output]") {
+	const auto folder = fs::temp_directory_path() / "iopt_output_writer_replace_test";
+	fs::remove_all(folder);
+	fs::create_directory(folder);
+
+	const auto imagePath = (folder / "image.jpg").string();
+	const std::vector<uint8_t> original(5000, 3);
+
+	OutputWriter writer;
+
+	auto image = writer.Create(imagePath);
+	OutputWriter::WriteAll(image, original.data(), original.size());
+	REQUIRE(writer.Commit(image, imagePath));
+
+	const auto permissions = fs::perms::owner_read | fs::perms::owner_write | fs::perms::group_read;
+	const auto modified = fs::last_write_time(imagePath) - std::chrono::hours(24);
+
+	fs::permissions(imagePath, permissions);
+	fs::last_write_time(imagePath, modified);
+
+	const std::vector<uint8_t> larger(6000, 4);
+
+	auto rejected = writer.Create(imagePath);
+	OutputWriter::WriteAll(rejected, larger.data(), larger.size());
+
+	REQUIRE_THROWS_AS(writer.Replace(rejected, imagePath), std::runtime_error);
+	REQUIRE(readFile(imagePath) == original);
+
+	const std::vector<uint8_t> smaller(1000, 5);
+
+	auto replacement = writer.Create(imagePath);
+	OutputWriter::WriteAll(replacement, smaller.data(), smaller.size());
+	writer.Replace(replacement, imagePath);
+
+	REQUIRE(readFile(imagePath) == smaller);
+	REQUIRE(fs::status(imagePath).permissions() == permissions);
+	REQUIRE(fs::last_write_time(imagePath) == modified);
+
+	rejected = OutputWriter::PendingFile();
+
+	REQUIRE(countFiles(folder) == 1);
+
+	fs::remove_all(folder);
+}
+
+TEST_CASE("Pending files never touch the files of others", "[output]") {
+	const auto folder = fs::temp_directory_path() / "iopt_output_writer_others_test";
+	fs::remove_all(folder);
+	fs::create_directory(folder);
+
+	const auto imagePath = (folder / "image.jpg").string();
+	const auto otherPath = imagePath + ".tmp";
+
+	const std::vector<uint8_t> other(10, 9);
+	const std::vector<uint8_t> original(5000, 3);
+	const std::vector<uint8_t> smaller(1000, 5);
+
+	std::ofstream(otherPath, std::ios::binary).write(reinterpret_cast<const char*>(other.data()), other.size());
+
+	OutputWriter writer;
+
+	auto image = writer.Create(imagePath);
+	OutputWriter::WriteAll(image, original.data(), original.size());
+	REQUIRE(writer.Commit(image, imagePath));
+
+	auto output = writer.Create(imagePath);
+	OutputWriter::WriteAll(output, smaller.data(), smaller.size());
+	REQUIRE(writer.Commit(output, (folder / "image_compressed0.jpg").string()));
+
+	auto replacement = writer.Create(imagePath);
+	OutputWriter::WriteAll(replacement, smaller.data(), smaller.size());
+	writer.Replace(replacement, imagePath);
+
+	REQUIRE(readFile(imagePath) == smaller);
+	REQUIRE(readFile(otherPath) == other);
+	REQUIRE(countFiles(folder) == 3);
+
+	fs::remove_all(folder);
+}
+
+#ifndef _WIN32
+TEST_CASE("Originals are cloned where they can't be linked", "[output]") {
+	// Needs a second file system, /dev/shm is one on most Linux systems
+	const fs::path otherFileSystem = "/dev/shm";
+
+	struct stat temporaryStatus;
+	struct stat otherStatus;
+
+	if (stat(fs::temp_directory_path().c_str(), &temporaryStatus) != 0 || stat(otherFileSystem.c_str(), &otherStatus) != 0 || temporaryStatus.st_dev == otherStatus.st_dev)
+	{
+		WARN("No second file system to link across");
+
+		return;
+	}
+
+	const auto folder = fs::temp_directory_path() / "iopt_output_writer_cross_test";
+	const auto outputFolder = otherFileSystem / "iopt_output_writer_cross_test";
+
+	fs::remove_all(folder);
+	fs::remove_all(outputFolder);
+	fs::create_directory(folder);
+	fs::create_directory(outputFolder);
+
+	const std::vector<uint8_t> content(3000000, 7);
+	const std::vector<uint8_t> taken(10, 1);
+	const auto imagePath = (folder / "image.jpg").string();
+	const auto takenPath = (outputFolder / "image_compressed0.jpg").string();
+	const auto nextPath = (outputFolder / "image_compressed1.jpg").string();
+
+	OutputWriter writer;
+
+	auto original = writer.Create(imagePath);
+	OutputWriter::WriteAll(original, content.data(), content.size());
+	REQUIRE(writer.Commit(original, imagePath));
+
+	std::ofstream(takenPath, std::ios::binary).write(reinterpret_cast<const char*>(taken.data()), taken.size());
+
+	// The clone made for a taken name is discarded, the next name gets a new one
+	REQUIRE_FALSE(writer.LinkOriginal(imagePath, takenPath));
+	REQUIRE(countFiles(outputFolder) == 1);
+	REQUIRE(readFile(takenPath) == taken);
+
+	REQUIRE(writer.LinkOriginal(imagePath, nextPath));
+	REQUIRE(readFile(nextPath) == content);
+	REQUIRE(countFiles(outputFolder) == 2);
+
+	fs::remove_all(folder);
+	fs::remove_all(outputFolder);
+}
+#endif
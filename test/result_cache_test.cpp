@@ -0,0 +1,177 @@
+#include <catch2/catch.hpp>
+
+#include <iopt/image_similarity.hpp>
+
+#include "result_cache.hpp"
+#include "xxhash.hpp"
+
+#include <cstring>
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+namespace {
+	// Removed on construction and destruction, so a failed run doesn't affect the next one
+	struct TemporaryFile
+	{
+		TemporaryFile(const std::string& name) : path{ (fs::temp_directory_path() / name).string() } { fs::remove(path); }
+		~TemporaryFile() { fs::remove(path); }
+
+		std::string path;
+	};
+}
+
+TEST_CASE("Xxh64 matches the reference values", "[cache]") {
+	const char* text = "Nobody inspects the spammish repetition";
+
+	REQUIRE(xxhash::hash64("", 0) == 0xEF46DB3751D8E999ULL);
+	REQUIRE(xxhash::hash64("a", 1) == 0xD24EC4F1A98C6E5BULL);
+	REQUIRE(xxhash::hash64("abc", 3) == 0x44BC2CF5AD770999ULL);
+	REQUIRE(xxhash::hash64(text, std::strlen(text)) == 0xFBCEA83C8A378BF1ULL);
+}
+
+TEST_CASE("Result cache keeps its entries across runs", "[cache]") {
+	TemporaryFile file{ "iopt_result_cache_test.bin" };
+
+	{
+		ResultCache cache{ file.path };
+
+		REQUIRE(cache.Size() == 0);
+
+		cache.Add(1, 0.9999f, { 80, { 1000, 800 } });
+		cache.Add(1, 0.999f, { 70, { 1000, 600 } });
+		cache.Add(2, 0.9999f, { 0, { 500, 500 } });
+		cache.Add(1, 0.9999f, { 82, { 1000, 820 } });
+	}
+
+	// Half a record, as left by an interrupted run
+	{
+		std::FILE* append = std::fopen(file.path.c_str(), "ab");
+		std::fwrite("partial", 1, 7, append);
+		std::fclose(append);
+	}
+
+	ResultCache cache{ file.path };
+
+	REQUIRE(cache.Size() == 3);
+
+	auto replaced = cache.Find(1, 0.9999f);
+	REQUIRE(replaced);
+	REQUIRE(replaced->quality == 82);
+	REQUIRE(replaced->result.GetCompressedSize() == 820);
+
+	REQUIRE(cache.Find(1, 0.999f)->result.GetCompressedSize() == 600);
+	REQUIRE(cache.Find(2, 0.9999f)->quality == 0);
+	REQUIRE_FALSE(cache.Find(2, 0.999f));
+	REQUIRE_FALSE(cache.Find(3, 0.9999f));
+
+	// Appending after the cut record still lines up
+	cache.Add(3, 0.9999f, { 90, { 300, 200 } });
+
+	REQUIRE(ResultCache{ file.path }.Find(3, 0.9999f)->result.GetCompressedSize() == 200);
+}
+
+TEST_CASE("Result cache rejects other files", "[cache]") {
+	TemporaryFile file{ "iopt_result_cache_invalid.bin" };
+
+	{
+		std::FILE* other = std::fopen(file.path.c_str(), "wb");
+		std::fwrite("not a cache file", 1, 16, other);
+		std::fclose(other);
+	}
+
+	REQUIRE_THROWS_AS(ResultCache{ file.path }, std::runtime_error);
+}
+
+TEST_CASE("Result cache converts the files of the first format", "[cache]") {
+	TemporaryFile file{ "iopt_result_cache_version1.bin" };
+
+	// Content hash, similarity bits, quality, original size, compressed size
+	struct RecordVersion1
+	{
+		uint64_t contentHash;
+		uint32_t similarityBits;
+		uint32_t quality;
+		uint64_t originalSize;
+		uint64_t compressedSize;
+	};
+
+	const float similarity = 0.9999f;
+	uint32_t similarityBits;
+	std::memcpy(&similarityBits, &similarity, sizeof(similarityBits));
+
+	const RecordVersion1 records[] = { { 1, similarityBits, 80, 1000, 600 }, { 2, similarityBits, 0, 500, 500 } };
+
+	{
+		std::FILE* version1 = std::fopen(file.path.c_str(), "wb");
+		std::fwrite("iOptCac1", 1, 8, version1);
+		std::fwrite(records, sizeof(RecordVersion1), 2, version1);
+
+		// Cut short by an interrupted run
+		std::fwrite(records, 1, 5, version1);
+		std::fclose(version1);
+	}
+
+	{
+		ResultCache cache{ file.path };
+
+		REQUIRE(cache.WasConverted());
+		REQUIRE(cache.Size() == 2);
+		REQUIRE(cache.Find(1, similarity)->quality == 80);
+		REQUIRE(cache.Find(1, similarity)->result.GetCompressedSize() == 600);
+		REQUIRE(cache.Find(2, similarity)->quality == 0);
+
+		cache.Add(3, similarity, { 90, { 300, 200 } });
+	}
+
+	ResultCache cache{ file.path };
+
+	REQUIRE_FALSE(cache.WasConverted());
+	REQUIRE(cache.Size() == 3);
+	REQUIRE(cache.Find(1, similarity)->result.GetOriginalSize() == 1000);
+	REQUIRE(cache.Find(3, similarity)->quality == 90);
+}
+
+TEST_CASE("Result cache recognizes unchanged files from their metadata", "[cache]") {
+	TemporaryFile file{ "iopt_result_cache_files.bin" };
+	TemporaryFile image{ "iopt_result_cache_image.jpg" };
+
+	{
+		std::FILE* content = std::fopen(image.path.c_str(), "wb");
+		std::fwrite("first version", 1, 13, content);
+		std::fclose(content);
+	}
+
+	auto identity = ResultCache::Identify(image.path);
+
+	// Always hashed where stat isn't available
+	if (!identity)
+	{
+		return;
+	}
+
+	REQUIRE(identity->size == 13);
+
+	{
+		ResultCache cache{ file.path };
+
+		REQUIRE_FALSE(cache.FindContentHash(*identity));
+
+		cache.AddFile(*identity, 42);
+		cache.Add(42, 0.9999f, { 75, { 13, 10 } });
+	}
+
+	ResultCache cache{ file.path };
+
+	REQUIRE(cache.FindContentHash(*identity) == 42u);
+	REQUIRE(cache.Size() == 1);
+
+	{
+		std::FILE* content = std::fopen(image.path.c_str(), "ab");
+		std::fwrite(", edited", 1, 8, content);
+		std::fclose(content);
+	}
+
+	REQUIRE_FALSE(cache.FindContentHash(*ResultCache::Identify(image.path)));
+}
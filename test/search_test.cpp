@@ -0,0 +1,213 @@
+#include <catch2/catch.hpp>
+
+#include <iopt/image.hpp>
+#include <iopt/image_similarity.hpp>
+#include <iopt/search_strategy.hpp>
+
+#include <iopt/logger.hpp>
+
+#include "image_processor.hpp"
+#include "jpeg.hpp"
+#include "optimization_sequence.hpp"
+#include "thread_pool.hpp"
+#include "test_images.hpp"
+
+#include <cstdlib>
+#include <iterator>
+
+namespace {
+	const float targets[] = { 0.999f, 0.9995f, 0.9999f, 0.99995f };
+}
+
+TEST_CASE("Best quality is picked among exact ssim values", "[search]") {
+	OptimizationSequence qualities{ 0.999f };
+
+	qualities.AddOptimizationResult(80, 0.9985f);
+	qualities.AddOptimizationResult(90, 0.9993f);
+
+	// An early stop value, closer to the target than the real ssim of that quality can be
+	qualities.AddOptimizationResult(70, 0.9989f, false);
+
+	REQUIRE(qualities.BestQuality() == 90);
+
+	auto bracket = qualities.Bracket();
+
+	REQUIRE(bracket.first->first == 80);
+	REQUIRE(bracket.second->first == 90);
+
+	qualities.ReplaceEstimate(70, 0.9990f);
+
+	REQUIRE(qualities.IsExact(70));
+	REQUIRE(qualities.BestQuality() == 70);
+}
+
+TEST_CASE("Interpolation search ends next to the bisection result", "[search]") {
+	auto& codec = jpeg::thread_codec();
+
+	for (unsigned int seed = 1; seed <= 3; seed++)
+	{
+		auto image = syntheticImage(640, 480, seed);
+
+		for (auto target : targets)
+		{
+			auto bisection = ImageProcessor::SearchBestQuality(image, target, codec, SearchStrategy::Bisection);
+			auto interpolation = ImageProcessor::SearchBestQuality(image, target, codec, SearchStrategy::Interpolation);
+
+			INFO("seed " << seed << " target " << target);
+
+			REQUIRE(std::abs(static_cast<int>(bisection.BestQuality()) - static_cast<int>(interpolation.BestQuality())) <= 1);
+		}
+	}
+}
+
+TEST_CASE("Parallel search ends next to the sequential result", "[search]") {
+	Logger logger;
+	ThreadPool threadPool{ 4 };
+	ImageProcessor processor{ logger, threadPool };
+
+	auto& codec = jpeg::thread_codec();
+	auto image = syntheticImage(640, 480);
+
+	const unsigned int parallelProbes = GENERATE(2u, 3u, 4u, 7u);
+
+	for (auto target : targets)
+	{
+		auto sequential = ImageProcessor::SearchBestQuality(image, target, codec, SearchStrategy::Bisection);
+		auto parallel = processor.OptimizeImage(image, target, codec, { MINIMUM_QUALITY, MAXIMUM_QUALITY }, parallelProbes);
+
+		INFO("probes " << parallelProbes << " target " << target);
+
+		REQUIRE(std::abs(static_cast<int>(sequential.BestQuality()) - static_cast<int>(parallel)) <= 1);
+	}
+}
+
+TEST_CASE("Parallel search stays inside ranges narrower than its probes", "[search]") {
+	Logger logger;
+	ThreadPool threadPool{ 4 };
+	ImageProcessor processor{ logger, threadPool };
+
+	auto& codec = jpeg::thread_codec();
+	auto image = syntheticImage(640, 480);
+
+	const unsigned int parallelProbes = GENERATE(4u, 8u);
+
+	for (Quality width : { 0u, 1u, 2u, 3u })
+	{
+		for (Quality minimum : { 60u, 85u, 97u })
+		{
+			const Quality maximum = minimum + width;
+
+			auto sequential = ImageProcessor::SearchBestQuality(image, 0.9999f, codec, SearchStrategy::Bisection, { minimum, maximum });
+			auto parallel = processor.OptimizeImage(image, 0.9999f, codec, { minimum, maximum }, parallelProbes);
+
+			INFO("probes " << parallelProbes << " range " << minimum << "-" << maximum);
+
+			REQUIRE(parallel >= minimum);
+			REQUIRE(parallel <= maximum);
+			REQUIRE(std::abs(static_cast<int>(sequential.BestQuality()) - static_cast<int>(parallel)) <= 1);
+		}
+	}
+}
+
+TEST_CASE("Images too small for a proxy are searched directly", "[search]") {
+	Logger logger;
+	ThreadPool threadPool{ 1 };
+	ImageProcessor processor{ logger, threadPool };
+
+	auto& codec = jpeg::thread_codec();
+	auto image = syntheticImage(640, 480);
+
+	const auto direct = processor.OptimizeImage(image, 0.9999f, codec, { MINIMUM_QUALITY, MAXIMUM_QUALITY });
+
+	processor.SetSearchProxy(GENERATE(SearchProxy::Downscaled, SearchProxy::Tiles));
+
+	REQUIRE(processor.OptimizeImage(image, 0.9999f, codec, { MINIMUM_QUALITY, MAXIMUM_QUALITY }) == direct);
+}
+
+TEST_CASE("Proxy estimates meet the target on the full image", "[search]") {
+	Logger logger;
+	ThreadPool threadPool{ 1 };
+	ImageProcessor processor{ logger, threadPool };
+
+	auto& codec = jpeg::thread_codec();
+
+	// Large enough for both proxies
+	auto image = syntheticImage(1024, 1024);
+
+	processor.SetSearchProxy(GENERATE(SearchProxy::Downscaled, SearchProxy::Tiles));
+
+	// At 0.99999 the probe predicted from the estimate falls just below the target, the search goes on at full size
+	for (auto target : { 0.999f, 0.9999f, 0.99999f })
+	{
+		const auto quality = processor.OptimizeImage(image, target, codec, { MINIMUM_QUALITY, MAXIMUM_QUALITY });
+		const auto fullImage = ImageProcessor::SearchBestQuality(image, target, codec, SearchStrategy::Bisection, { quality, quality });
+
+		INFO("target " << target << " quality " << quality);
+
+		REQUIRE(fullImage.NumberOfIterations() == 1);
+		REQUIRE(fullImage.begin()->second > target);
+	}
+}
+
+TEST_CASE("Search strategy benchmark", "[.][benchmark]") {
+	auto& codec = jpeg::thread_codec();
+
+	auto image = syntheticImage(2048, 1536);
+
+	size_t bisectionIterations = 0;
+	size_t interpolationIterations = 0;
+
+	for (auto target : targets)
+	{
+		bisectionIterations += ImageProcessor::SearchBestQuality(image, target, codec, SearchStrategy::Bisection).NumberOfIterations();
+		interpolationIterations += ImageProcessor::SearchBestQuality(image, target, codec, SearchStrategy::Interpolation).NumberOfIterations();
+	}
+
+	WARN("Iterations over " << std::size(targets) << " targets: bisection " << bisectionIterations << ", interpolation " << interpolationIterations);
+
+	BENCHMARK("bisection, 3 MP") {
+		return ImageProcessor::SearchBestQuality(image, 0.9999f, codec, SearchStrategy::Bisection).BestQuality();
+	};
+
+	BENCHMARK("interpolation, 3 MP") {
+		return ImageProcessor::SearchBestQuality(image, 0.9999f, codec, SearchStrategy::Interpolation).BestQuality();
+	};
+}
+
+TEST_CASE("Search proxy benchmark", "[.][benchmark]") {
+	Logger logger;
+	ThreadPool threadPool{ 1 };
+	ImageProcessor processor{ logger, threadPool };
+
+	auto& codec = jpeg::thread_codec();
+	auto image = syntheticImage(4000, 3000);
+
+	for (auto target : targets)
+	{
+		processor.SetSearchProxy(SearchProxy::None);
+		const auto direct = processor.OptimizeImage(image, target, codec, { MINIMUM_QUALITY, MAXIMUM_QUALITY });
+
+		processor.SetSearchProxy(SearchProxy::Downscaled);
+		const auto downscaled = processor.OptimizeImage(image, target, codec, { MINIMUM_QUALITY, MAXIMUM_QUALITY });
+
+		processor.SetSearchProxy(SearchProxy::Tiles);
+		const auto tiles = processor.OptimizeImage(image, target, codec, { MINIMUM_QUALITY, MAXIMUM_QUALITY });
+
+		WARN("Target " << target << ": full image " << direct << ", downscaled proxy " << downscaled << ", tiles proxy " << tiles);
+	}
+
+	BENCHMARK("full image, 12 MP") {
+		processor.SetSearchProxy(SearchProxy::None);
+		return processor.OptimizeImage(image, 0.9999f, codec, { MINIMUM_QUALITY, MAXIMUM_QUALITY });
+	};
+
+	BENCHMARK("downscaled proxy, 12 MP") {
+		processor.SetSearchProxy(SearchProxy::Downscaled);
+		return processor.OptimizeImage(image, 0.9999f, codec, { MINIMUM_QUALITY, MAXIMUM_QUALITY });
+	};
+
+	BENCHMARK("tiles proxy, 12 MP") {
+		processor.SetSearchProxy(SearchProxy::Tiles);
+		return processor.OptimizeImage(image, 0.9999f, codec, { MINIMUM_QUALITY, MAXIMUM_QUALITY });
+	};
+}
@@ -0,0 +1,305 @@
+#include <catch2/catch.hpp>
+
+#include <iopt/image.hpp>
+#include <iopt/image_similarity.hpp>
+
+#include "ssim_kernels.hpp"
+
+#include <random>
+#include <vector>
+
+namespace kernels = ImageSimilarity::kernels;
+
+namespace {
+	constexpr int WINDOW = 8;
+
+	Image randomImage(int width, int height, std::mt19937& generator)
+	{
+		std::uniform_int_distribution<int> distribution(0, 255);
+
+		Image image{ width, height, std::vector<unsigned char>(width * height) };
+
+		for (auto& pixel : image.data)
+		{
+			pixel = static_cast<unsigned char>(distribution(generator));
+		}
+
+		return image;
+	}
+
+	Image addNoise(const Image& image, int amplitude, std::mt19937& generator)
+	{
+		std::uniform_int_distribution<int> distribution(-amplitude, amplitude);
+
+		Image noisy = image;
+
+		for (auto& pixel : noisy.data)
+		{
+			pixel = static_cast<unsigned char>(std::min(255, std::max(0, pixel + distribution(generator))));
+		}
+
+		return noisy;
+	}
+
+	struct WindowSums
+	{
+		std::vector<float> ref, cmp, refSquared, cmpSquared, both;
+	};
+
+	WindowSums windowSums(const Image& ref, const Image& cmp)
+	{
+		WindowSums sums;
+
+		for (int y = 0; y + WINDOW <= ref.height; y++)
+		{
+			for (int x = 0; x + WINDOW <= ref.width; x++)
+			{
+				double r = 0, c = 0, rr = 0, cc = 0, rc = 0;
+
+				for (int row = y; row < y + WINDOW; row++)
+				{
+					for (int col = x; col < x + WINDOW; col++)
+					{
+						double refValue = ref.data[row * ref.width + col];
+						double cmpValue = cmp.data[row * cmp.width + col];
+
+						r += refValue;
+						c += cmpValue;
+						rr += refValue * refValue;
+						cc += cmpValue * cmpValue;
+						rc += refValue * cmpValue;
+					}
+				}
+
+				sums.ref.push_back(static_cast<float>(r));
+				sums.cmp.push_back(static_cast<float>(c));
+				sums.refSquared.push_back(static_cast<float>(rr));
+				sums.cmpSquared.push_back(static_cast<float>(cc));
+				sums.both.push_back(static_cast<float>(rc));
+			}
+		}
+
+		return sums;
+	}
+
+	// Means of the scale x scale blocks, the pixels past the last whole block are left out
+	std::vector<double> decimate(const Image& image, int scale, int& width, int& height)
+	{
+		width = image.width / scale;
+		height = image.height / scale;
+
+		std::vector<double> decimated(width * height, 0.0);
+
+		for (int y = 0; y < height * scale; y++)
+		{
+			for (int x = 0; x < width * scale; x++)
+			{
+				decimated[(y / scale) * width + x / scale] += image.data[y * image.width + x];
+			}
+		}
+
+		for (auto& value : decimated)
+		{
+			value /= scale * scale;
+		}
+
+		return decimated;
+	}
+
+	// Mean ssim of the 8x8 windows of the decimated images, everything in double
+	double referenceSsim(const Image& ref, const Image& cmp, int scale)
+	{
+		const double C1 = (0.01 * 255) * (0.01 * 255);
+		const double C2 = (0.03 * 255) * (0.03 * 255);
+		const double n = WINDOW * WINDOW;
+
+		int width = 0;
+		int height = 0;
+		const auto refPixels = decimate(ref, scale, width, height);
+		const auto cmpPixels = decimate(cmp, scale, width, height);
+
+		double total = 0.0;
+		int windows = 0;
+
+		for (int y = 0; y + WINDOW <= height; y++)
+		{
+			for (int x = 0; x + WINDOW <= width; x++)
+			{
+				double r = 0, c = 0, rr = 0, cc = 0, rc = 0;
+
+				for (int row = y; row < y + WINDOW; row++)
+				{
+					for (int col = x; col < x + WINDOW; col++)
+					{
+						double refValue = refPixels[row * width + col];
+						double cmpValue = cmpPixels[row * width + col];
+
+						r += refValue;
+						c += cmpValue;
+						rr += refValue * refValue;
+						cc += cmpValue * cmpValue;
+						rc += refValue * cmpValue;
+					}
+				}
+
+				double refMu = r / n;
+				double cmpMu = c / n;
+				double refSigma = rr / n - refMu * refMu;
+				double cmpSigma = cc / n - cmpMu * cmpMu;
+				double sigmaBoth = rc / n - refMu * cmpMu;
+
+				total += ((2 * refMu * cmpMu + C1) * (2 * sigmaBoth + C2)) / ((refMu * refMu + cmpMu * cmpMu + C1) * (refSigma + cmpSigma + C2));
+				windows++;
+			}
+		}
+
+		return total / windows;
+	}
+}
+
+TEST_CASE("Simd kernels match the scalar implementation", "[ssim]") {
+	const auto& scalar = kernels::Scalar();
+	const auto& best = kernels::Best();
+
+	INFO("Selected kernels: " << best.name);
+
+	std::mt19937 generator(42);
+
+	// Odd sizes so the scalar tails are exercised too
+	auto ref = randomImage(77, 53, generator);
+	auto cmp = addNoise(ref, 12, generator);
+
+	const size_t count = ref.data.size();
+
+	SECTION("conversion to float is exact") {
+		std::vector<float> expected(count), actual(count);
+
+		scalar.convertToFloat(ref.data.data(), expected.data(), count);
+		best.convertToFloat(ref.data.data(), actual.data(), count);
+
+		REQUIRE(actual == expected);
+	}
+
+	SECTION("products are exact") {
+		std::vector<float> refFloat(count), cmpFloat(count);
+		scalar.convertToFloat(ref.data.data(), refFloat.data(), count);
+		scalar.convertToFloat(cmp.data.data(), cmpFloat.data(), count);
+
+		std::vector<float> expected[3] = { std::vector<float>(count), std::vector<float>(count), std::vector<float>(count) };
+		std::vector<float> actual[3] = { std::vector<float>(count), std::vector<float>(count), std::vector<float>(count) };
+
+		scalar.products(refFloat.data(), cmpFloat.data(), expected[0].data(), expected[1].data(), expected[2].data(), count);
+		best.products(refFloat.data(), cmpFloat.data(), actual[0].data(), actual[1].data(), actual[2].data(), count);
+
+		REQUIRE(actual[0] == expected[0]);
+		REQUIRE(actual[1] == expected[1]);
+		REQUIRE(actual[2] == expected[2]);
+	}
+
+	SECTION("ssim sum is within tolerance") {
+		auto sums = windowSums(ref, cmp);
+		const float norm = 1.0f / (WINDOW * WINDOW);
+
+		const auto windows = sums.ref.size();
+
+		double expected = scalar.ssimSum(sums.ref.data(), sums.cmp.data(), sums.refSquared.data(), sums.cmpSquared.data(), sums.both.data(), windows, norm);
+		double actual = best.ssimSum(sums.ref.data(), sums.cmp.data(), sums.refSquared.data(), sums.cmpSquared.data(), sums.both.data(), windows, norm);
+
+		REQUIRE(actual / windows == Approx(expected / windows).epsilon(1e-6));
+	}
+}
+
+TEST_CASE("Ssim of identical images is one", "[ssim]") {
+	std::mt19937 generator(7);
+
+	auto image = randomImage(300, 200, generator);
+
+	REQUIRE(ImageSimilarity::ComputeSsim(image, image).GetValue() == Approx(1.0f).epsilon(1e-6));
+}
+
+TEST_CASE("Undecimated ssim matches a double precision reference", "[ssim]") {
+	std::mt19937 generator(11);
+
+	// Small enough not to be decimated
+	auto ref = randomImage(131, 97, generator);
+	auto cmp = addNoise(ref, 20, generator);
+
+	const double n = WINDOW * WINDOW;
+	const double C1 = (0.01 * 255) * (0.01 * 255);
+	const double C2 = (0.03 * 255) * (0.03 * 255);
+
+	auto sums = windowSums(ref, cmp);
+
+	double total = 0.0;
+
+	for (size_t i = 0; i < sums.ref.size(); i++)
+	{
+		double refMu = sums.ref[i] / n;
+		double cmpMu = sums.cmp[i] / n;
+		double refSigma = sums.refSquared[i] / n - refMu * refMu;
+		double cmpSigma = sums.cmpSquared[i] / n - cmpMu * cmpMu;
+		double sigmaBoth = sums.both[i] / n - refMu * cmpMu;
+
+		total += ((2 * refMu * cmpMu + C1) * (2 * sigmaBoth + C2)) / ((refMu * refMu + cmpMu * cmpMu + C1) * (refSigma + cmpSigma + C2));
+	}
+
+	const double expected = total / sums.ref.size();
+
+	REQUIRE(ImageSimilarity::ComputeSsim(ref, cmp).GetValue() == Approx(expected).epsilon(1e-6));
+}
+
+TEST_CASE("Decimated ssim matches a double precision reference", "[ssim]") {
+	std::mt19937 generator(13);
+
+	// Both decimated by 3, the widths aren't multiples of it and neither is the second height
+	auto size = GENERATE(std::make_pair(1024, 768), std::make_pair(1031, 881));
+
+	auto ref = randomImage(size.first, size.second, generator);
+	auto cmp = addNoise(ref, 40, generator);
+
+	const double expected = referenceSsim(ref, cmp, 3);
+
+	REQUIRE(ImageSimilarity::ComputeSsim(ref, cmp).GetValue() == Approx(expected).epsilon(1e-6));
+
+	// The early exit compares every band when the target is the value itself
+	REQUIRE(ImageSimilarity::ComputeSsim(ref, cmp, static_cast<float>(expected), 1.0).similarity.GetValue() == Approx(expected).epsilon(1e-6));
+}
+
+TEST_CASE("Early exit ssim stays on the side of the target", "[ssim]") {
+	std::mt19937 generator(5);
+
+	// Tall enough for several bands, both without and with decimation
+	auto size = GENERATE(std::make_pair(200, 700), std::make_pair(1100, 1400));
+
+	auto ref = randomImage(size.first, size.second, generator);
+	auto cmp = addNoise(ref, 6, generator);
+
+	const float exact = ImageSimilarity::ComputeSsim(ref, cmp).GetValue();
+
+	for (float target : { 0.5f, exact - 0.05f, exact + 0.05f, 0.9999f })
+	{
+		for (double confidence : { 1.0, 0.99 })
+		{
+			const auto estimate = ImageSimilarity::ComputeSsim(ref, cmp, target, confidence);
+
+			REQUIRE((estimate.similarity.GetValue() > target) == (exact > target));
+
+			if (estimate.exact)
+			{
+				REQUIRE(estimate.similarity.GetValue() == Approx(exact).epsilon(1e-6));
+			}
+		}
+	}
+
+	// Far below the target a few bands are enough
+	REQUIRE_FALSE(ImageSimilarity::ComputeSsim(ref, cmp, 0.9999f, 1.0).exact);
+
+	// Too close to decide early, the whole image is compared
+	const auto closest = ImageSimilarity::ComputeSsim(ref, cmp, exact, 1.0);
+
+	REQUIRE(closest.exact);
+	REQUIRE(closest.similarity.GetValue() == Approx(exact).epsilon(1e-6));
+
+	// Above the target the bands left are compared in runs, which cover the same windows
+	REQUIRE(ImageSimilarity::ComputeSsim(ref, cmp, exact - 0.05f, 1.0).similarity.GetValue() == Approx(exact).epsilon(1e-6));
+}
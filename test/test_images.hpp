@@ -0,0 +1,29 @@
+#pragma once
+
+#include <iopt/image.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+// Grayscale image with smooth shapes, edges and some grain, compresses roughly like a photo
+inline Image syntheticImage(int width, int height, unsigned int seed = 1)
+{
+	std::mt19937 generator(seed);
+	std::normal_distribution<float> grain(0.0f, 4.0f);
+
+	Image image{ width, height, std::vector<unsigned char>(static_cast<size_t>(width) * height) };
+
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			float value = 128.0f + 60.0f * std::sin(x / 17.0f) * std::cos(y / 23.0f) + (((x / 64) + (y / 64)) % 2 ? 30.0f : -30.0f) + grain(generator);
+
+			image.data[static_cast<size_t>(y) * width + x] = static_cast<unsigned char>(std::min(255.0f, std::max(0.0f, value)));
+		}
+	}
+
+	return image;
+}
@@ -0,0 +1,182 @@
+#include <catch2/catch.hpp>
+
+#include "bounded_queue.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+TEST_CASE("Task group waits for the tasks its tasks add", "[pool]") {
+	ThreadPool threadPool{ 4 };
+	TaskGroup taskGroup{ threadPool };
+
+	std::atomic<unsigned int> leaves{ 0 };
+
+	// Binary tree of depth 10, every inner task adds its two children
+	std::function<void(unsigned int)> branch = [&](unsigned int depth) {
+		if (depth == 0)
+		{
+			leaves++;
+			return;
+		}
+
+		taskGroup.Run([&branch, depth]() { branch(depth - 1); });
+		taskGroup.Run([&branch, depth]() { branch(depth - 1); });
+	};
+
+	taskGroup.Run([&branch]() { branch(10); });
+	taskGroup.Wait();
+
+	REQUIRE(leaves == 1024u);
+}
+
+TEST_CASE("Tasks from outside the pool start in submission order", "[pool]") {
+	// A single worker, the submitting thread doesn't run tasks since it never calls Wait
+	ThreadPool threadPool{ 2 };
+
+	std::mutex mutex;
+	std::vector<unsigned int> started;
+	std::vector<std::future<void>> futures;
+
+	for (unsigned int task = 0; task < 100; task++)
+	{
+		futures.push_back(threadPool.Submit([&mutex, &started, task]() {
+			std::lock_guard<std::mutex> lock(mutex);
+			started.push_back(task);
+		}));
+	}
+
+	for (auto& future : futures)
+	{
+		future.get();
+	}
+
+	REQUIRE(started.size() == 100);
+	REQUIRE(std::is_sorted(started.begin(), started.end()));
+}
+
+TEST_CASE("Tasks waiting on the tasks they submit don't block the pool", "[pool]") {
+	// Fewer threads than waiting tasks, every waiting task has to run the others
+	ThreadPool threadPool{ 2 };
+
+	std::function<unsigned int(unsigned int)> fibonacci = [&](unsigned int n) -> unsigned int {
+		if (n < 2)
+		{
+			return n;
+		}
+
+		auto first = threadPool.Submit([&fibonacci, n]() { return fibonacci(n - 1); });
+		auto second = threadPool.Submit([&fibonacci, n]() { return fibonacci(n - 2); });
+
+		return threadPool.Wait(first) + threadPool.Wait(second);
+	};
+
+	auto result = threadPool.Submit([&fibonacci]() { return fibonacci(16); });
+
+	REQUIRE(threadPool.Wait(result) == 987u);
+
+	auto failing = threadPool.Submit([]() -> int { throw std::runtime_error("task failed"); });
+
+	REQUIRE_THROWS_AS(threadPool.Wait(failing), std::runtime_error);
+}
+
+TEST_CASE("Waits wake up for tasks and groups finished elsewhere", "[pool]") {
+	ThreadPool threadPool{ 2 };
+
+	SECTION("a group left by a thread outside the pool") {
+		TaskGroup taskGroup{ threadPool };
+		std::atomic<bool> left{ false };
+
+		taskGroup.Enter();
+
+		std::thread outside([&taskGroup, &left]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+			left = true;
+			taskGroup.Leave();
+		});
+
+		taskGroup.Wait();
+
+		REQUIRE(left);
+
+		outside.join();
+	}
+
+	SECTION("a task run by the worker while the waiting thread has nothing to run") {
+		std::atomic<bool> started{ false };
+
+		auto future = threadPool.Submit([&started]() {
+			started = true;
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+			return 7;
+		});
+
+		while (!started)
+		{
+			std::this_thread::yield();
+		}
+
+		REQUIRE(threadPool.Wait(future) == 7);
+	}
+}
+
+TEST_CASE("A pool of one thread runs everything in its waits", "[pool]") {
+	ThreadPool threadPool{ 1 };
+	TaskGroup taskGroup{ threadPool };
+
+	std::atomic<unsigned int> runs{ 0 };
+
+	for (unsigned int task = 0; task < 10; task++)
+	{
+		taskGroup.Run([&runs]() { runs++; });
+	}
+
+	taskGroup.Wait();
+
+	auto future = threadPool.Submit([&runs]() { return runs.load(); });
+
+	REQUIRE(threadPool.Wait(future) == 10u);
+}
+
+TEST_CASE("Bounded queue hands over every item and drains once closed", "[pool]") {
+	BoundedQueue<unsigned int> queue{ 2 };
+
+	std::atomic<unsigned int> sum{ 0 };
+	std::vector<std::thread> consumers;
+
+	for (int i = 0; i < 3; i++)
+	{
+		consumers.emplace_back([&]() {
+			unsigned int item;
+
+			while (queue.Pop(item))
+			{
+				sum += item;
+			}
+		});
+	}
+
+	// Far more items than the capacity, the producer waits on the consumers
+	for (unsigned int item = 1; item <= 1000; item++)
+	{
+		REQUIRE(queue.Push(item));
+	}
+
+	queue.Close();
+
+	for (auto& consumer : consumers)
+	{
+		consumer.join();
+	}
+
+	REQUIRE(sum == 500500u);
+	REQUIRE_FALSE(queue.Push(1));
+}